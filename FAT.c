@@ -7,10 +7,53 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <stdbool.h>
+#include <sys/mman.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+#include <errno.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
 
 #define DIR_ENTRY_SIZE 32
 #define ATTR_DIRECTORY 0x10
-#define MAX_OPEN_FILES 10 
+#define OPEN_TABLE_INITIAL 16   //open file slots, doubled when they run out
+#define MAX_DIR_DEPTH 128
+#define DENTRY_SLOTS 4096      //cached (parent, name) -> cluster lookups
+#define FAT_CHUNK_SECTORS 64   //FAT sectors loaded per cache miss
+#define FAT_ENTRY_MASK 0x0FFFFFFF
+#define DIR_CACHE_SLOTS 8      //directories kept in memory at once
+#define DEFAULT_CACHE_CLUSTERS 256
+#define READ_STAGING_SIZE (64 * 1024)   //largest chunk read prints at once
+#define ARENA_CLUSTERS 8                //cluster-sized scratch buffers per command
+#define BATCH_LOOKAHEAD 32              //queued batch commands scanned for prefetch
+#define LATENCY_BUCKETS 24              //power-of-two microsecond buckets, up to ~16 s
+#define FAT_BAD_CLUSTER 0x0FFFFFF7
+#define FSCK_MAX_THREADS 64
+#define FSCK_MAX_REPORTS 20             //problems printed one by one, the rest are only counted
+#define FSCK_CHUNK_ENTRIES 65536
+#define FRAG_MAX_REPORTS 20             //most fragmented files listed by frag
+#define BULK_IO_SIZE (1024 * 1024)      //largest single transfer for export and import
+#define BULK_PATH_MAX 1024
+#define SERVER_BACKLOG 64
+#define IO_QUEUE_DEPTH 32               //default requests in flight per bulk transfer
+#define IO_BATCH_MAX 256                //requests queued before a batch is submitted
+#define IO_SEGMENT_SIZE (128 * 1024)    //long runs are split so they still fill the queue
+#define READAHEAD_MIN_CLUSTERS 4        //first read-ahead window of a sequential reader
+#define READAHEAD_MAX_BYTES (1024 * 1024)   //largest window, two are kept per file
 
 //bootsector struct
 typedef struct {
@@ -20,946 +63,6044 @@ typedef struct {
     unsigned int totalClusters; 
     unsigned int sectorsPerFAT;
     unsigned long long sizeOfImage; 
+    unsigned short reservedSectors;
+    unsigned char numFATs;
+    unsigned int firstDataSector;
+    unsigned short fsInfoSector;
+    unsigned int totalSectors;
+    unsigned int maxCluster;    //one past the highest usable cluster number
 } BootSectorInfo;
 
 unsigned int getNextCluster(int fd, unsigned int currentCluster, BootSectorInfo* bsi);
+bool fileIsOpen(unsigned int dirCluster, unsigned int entryIndex);
 
 //struct that contains the current cluster, the name  and the name of the image
 typedef struct {
     unsigned int currentCluster; 
     char path[512]; 
     char imageName[256]; 
+    unsigned int parents[MAX_DIR_DEPTH];    //clusters of the directories above, parents[0] is the root
+    int depth;                              //how many entries of parents are in use
 } DirectoryContext;
 
 DirectoryContext currentDirectory;
 
+//working directory and parent stack of every session, so no session can remove a directory
+//another one is in or below; in server mode sessions join and leave, and rmdir and rm -r read it,
+//under the write side of imageLock, which also keeps cd (a reader) from moving a context meanwhile
+typedef struct {
+    DirectoryContext** contexts;
+    unsigned int count;
+    unsigned int capacity;
+} ContextRegistry;
+
+ContextRegistry sessionContexts = {NULL, 0, 0};
+
+bool registerContext(DirectoryContext* context) {
+    if (sessionContexts.count == sessionContexts.capacity) {
+        unsigned int capacity = sessionContexts.capacity ? sessionContexts.capacity * 2 : 16;
+        DirectoryContext** grown = realloc(sessionContexts.contexts, capacity * sizeof(DirectoryContext*));
+        if (!grown) {
+            return false;
+        }
+        sessionContexts.contexts = grown;
+        sessionContexts.capacity = capacity;
+    }
+    sessionContexts.contexts[sessionContexts.count++] = context;
+    return true;
+}
+
+void unregisterContext(DirectoryContext* context) {
+    for (unsigned int i = 0; i < sessionContexts.count; i++) {
+        if (sessionContexts.contexts[i] == context) {
+            sessionContexts.contexts[i] = sessionContexts.contexts[--sessionContexts.count];
+            return;
+        }
+    }
+}
+
+//whether any session has cluster as its working directory or one of the directories above it
+bool directoryInUse(unsigned int cluster) {
+    for (unsigned int i = 0; i < sessionContexts.count; i++) {
+        const DirectoryContext* context = sessionContexts.contexts[i];
+        if (context->currentCluster == cluster) {
+            return true;
+        }
+        for (int d = 0; d < context->depth; d++) {
+            if (context->parents[d] == cluster) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
 //struct to determine the number of entries a sector can hold
+//laid out exactly like the 32-byte on-disk FAT32 directory entry
 typedef struct {
     char name[11];
     uint8_t attr;
-    uint8_t reserved[20];
+    uint8_t reserved[8];        //NT flags, creation time/date, last access date
     uint16_t firstClusterHigh;
+    uint8_t reserved2[4];       //write time/date
     uint16_t firstClusterLow;
     uint32_t fileSize;
 } DirEntry;
 
+//run of physically contiguous clusters belonging to a file
+typedef struct {
+    unsigned long fileOffset;   //byte offset in the file where the run starts
+    unsigned int firstCluster;
+    unsigned int clusterCount;
+} Extent;
+
+//part of a file read ahead of a sequential reader, filled asynchronously
+typedef struct {
+    unsigned char* data;
+    unsigned long start;        //file offset of data[0]
+    unsigned long len;          //bytes requested, 0 when the window is free
+    unsigned long done;         //bytes that have arrived
+    unsigned int pending;       //requests still in flight
+} ReadAheadWindow;
+
 //struct to handle file opening
 //flags determine operation to carry out based on command input
 typedef struct {
-    char fileName[12];    
+    char fileName[256];   //path as typed at open
     int flags;            
     unsigned long offset; 
     unsigned int cluster; 
     unsigned int size;    
     bool isOpen;          
+    Extent* extents;            //built lazily on first access, NULL until then
+    unsigned int extentCount;
+    unsigned int extentCapacity;
+    bool extentsValid;
+    unsigned int dirCluster;    //directory holding the file's entry
+    unsigned int entryIndex;    //index of the entry in that directory
+    bool entryDirty;            //size or first cluster changed since the entry was written
+    unsigned char* writeBuffer; //one-cluster write-behind buffer, allocated on first write
+    unsigned long bufferStart;  //file offset of the cluster the buffer mirrors
+    unsigned long dirtyStart;   //buffered bytes not yet written, [dirtyStart, dirtyEnd)
+    unsigned long dirtyEnd;
+    unsigned long nextOffset;   //where the next read starts if the reader is sequential
+    unsigned int readAhead;     //read-ahead window in clusters, 0 until sequential reading starts
+    unsigned long aheadEnd;     //file offset up to which read-ahead has been issued
+    ReadAheadWindow* ahead;     //two windows, allocated on the first read-ahead
 } OpenFile;
 
-OpenFile openFiles[MAX_OPEN_FILES];  //aqrray to store open files
 
-//read data from a cluster and load it into memory buffer
-bool readCluster(int fd, unsigned int clusterNum, unsigned char* buffer, BootSectorInfo* bsi) {
-    unsigned long long sector = ((clusterNum - 2) * bsi->sectorsPerCluster) + bsi->rootCluster;
-    off_t offset = sector * bsi->bytesPerSector;
+//set when commands come from a script or pipe instead of a terminal
+bool batchMode = false;
 
-    //seek to the cluster
-    if (lseek(fd, offset, SEEK_SET) < 0) {
-        perror("Error seeking cluster");
-        return false;
+//stream of the client being served, NULL outside server sessions
+__thread FILE* sessionOut = NULL;
+
+FILE* output() {
+    return sessionOut ? sessionOut : stdout;
+}
+
+//status and success messages, suppressed in batch mode so only data and errors remain
+void status(const char* format, ...) {
+    if (batchMode) {
+        return;
     }
-    //read the cluster
-    if (read(fd, buffer, bsi->bytesPerSector * bsi->sectorsPerCluster) < 0) {
-        perror("Error reading cluster");
-        return false;
+    va_list args;
+    va_start(args, format);
+    vfprintf(output(), format, args);
+    va_end(args);
+}
+
+//command output and error messages, to the terminal or to the session's client
+void reply(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    vfprintf(output(), format, args);
+    va_end(args);
+}
+
+//command types counted by the stats command
+enum {
+    CMD_INFO, CMD_CD, CMD_LS, CMD_MKDIR, CMD_CREAT, CMD_RM, CMD_RMDIR, CMD_OPEN, CMD_CLOSE,
+    CMD_LSOF, CMD_LSEEK, CMD_READ, CMD_WRITE, CMD_FLUSH, CMD_STATS, CMD_FSCK, CMD_EXPORT, CMD_IMPORT, CMD_SYNC, CMD_FRAG, CMD_DEFRAG, CMD_OVERLAY, CMD_OTHER, CMD_COUNT
+};
+
+const char* commandNames[CMD_COUNT] = {
+    "info", "cd", "ls", "mkdir", "creat", "rm", "rmdir", "open", "close",
+    "lsof", "lseek", "read", "write", "flush", "stats", "fsck", "export", "import", "sync", "frag", "defrag", "overlay", "other"
+};
+
+//per command type counters, latency bucket i holds commands that took [2^i, 2^(i+1)) microseconds
+typedef struct {
+    unsigned long long calls;
+    unsigned long long totalMicros;
+    unsigned long long latency[LATENCY_BUCKETS];
+    unsigned long long syscalls;
+    unsigned long long bytesRead;
+    unsigned long long bytesWritten;
+    unsigned long long clusterReads;
+    unsigned long long clusterCacheHits;
+    unsigned long long fatLookups;
+} CommandStats;
+
+__thread CommandStats commandStats[CMD_COUNT];   //per session in server mode
+
+//counters charged by the I/O layer, points at the command being executed
+//(startup work such as mounting is charged to "other")
+__thread CommandStats* activeStats;
+
+int commandType(const char* command) {
+    static const struct { const char* prefix; int type; } prefixes[] = {
+        {"info", CMD_INFO}, {"cd ", CMD_CD}, {"ls", CMD_LS}, {"mkdir ", CMD_MKDIR}, {"creat ", CMD_CREAT},
+        {"rmdir ", CMD_RMDIR}, {"rm ", CMD_RM}, {"open ", CMD_OPEN}, {"close ", CMD_CLOSE}, {"lsof", CMD_LSOF},
+        {"lseek ", CMD_LSEEK}, {"read ", CMD_READ}, {"write ", CMD_WRITE}, {"flush", CMD_FLUSH}, {"stats", CMD_STATS},
+        {"fsck", CMD_FSCK}, {"export ", CMD_EXPORT}, {"import ", CMD_IMPORT}, {"sync", CMD_SYNC},
+        {"frag ", CMD_FRAG}, {"frag", CMD_FRAG}, {"defrag ", CMD_DEFRAG}, {"defrag", CMD_DEFRAG},
+        {"overlay ", CMD_OVERLAY}, {"overlay", CMD_OVERLAY}
+    };
+    for (size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++) {
+        size_t len = strlen(prefixes[i].prefix);
+        if (strncmp(command, prefixes[i].prefix, len) == 0 && (prefixes[i].prefix[len - 1] == ' ' || command[len] == '\0')) {
+            return prefixes[i].type;
+        }
     }
+    return CMD_OTHER;
+}
 
-    return true;
+unsigned long long monotonicMicros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
-//fucntion to handle the cd command
-void changeDirectory(int fd, const char* dirName, DirectoryContext* context, BootSectorInfo* bsi) {
-    if (strcmp(dirName, ".") == 0) {
-        printf("Staying in the current directory.\n");
-        return; 
+void recordCommandLatency(CommandStats* stats, unsigned long long micros) {
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && (micros >> (bucket + 1)) != 0) {
+        bucket++;
     }
+    stats->calls++;
+    stats->totalMicros += micros;
+    stats->latency[bucket]++;
+}
 
-    if (strcmp(dirName, "..") == 0) {
-        if (strcmp(context->path, "/") == 0) {
-            printf("Already in the root directory.\n");
-            return; 
+//upper bound of the latency bucket holding the given fraction of calls
+static unsigned long long latencyPercentile(CommandStats* stats, double fraction) {
+    unsigned long long target = (unsigned long long)(stats->calls * fraction);
+    unsigned long long seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += stats->latency[i];
+        if (seen > target) {
+            return 1ULL << (i + 1);
         }
+    }
+    return 1ULL << LATENCY_BUCKETS;
+}
 
-        //check for and handle slash in input
-        char* lastSlash = strrchr(context->path, '/');
-        if (lastSlash != NULL) {
-            if (lastSlash == context->path) {
-                *(lastSlash + 1) = '\0'; 
-            } else {
-                *lastSlash = '\0';
+//table of every command type used so far, followed by its latency histogram
+void printStats(FILE* out) {
+    fprintf(out, "%-7s %8s %10s %9s %9s %9s %12s %12s %9s %9s %9s\n", "command", "calls", "avg(us)", "p50<(us)",
+            "p99<(us)", "syscalls", "bytes read", "bytes writ", "clusters", "hits", "fat");
+    for (int t = 0; t < CMD_COUNT; t++) {
+        CommandStats* st = &commandStats[t];
+        if (st->calls == 0 && st->syscalls == 0 && st->clusterReads == 0 && st->fatLookups == 0) {
+            continue;
+        }
+        fprintf(out, "%-7s %8llu %10.1f %9llu %9llu %9llu %12llu %12llu %9llu %9llu %9llu\n", commandNames[t], st->calls,
+                st->calls ? (double)st->totalMicros / st->calls : 0.0,
+                st->calls ? latencyPercentile(st, 0.5) : 0, st->calls ? latencyPercentile(st, 0.99) : 0,
+                st->syscalls, st->bytesRead, st->bytesWritten, st->clusterReads, st->clusterCacheHits, st->fatLookups);
+        if (st->calls == 0) {
+            continue;
+        }
+        fprintf(out, "        latency:");
+        for (int i = 0; i < LATENCY_BUCKETS; i++) {
+            if (st->latency[i]) {
+                fprintf(out, " <%lluus:%llu", 1ULL << (i + 1), st->latency[i]);
             }
         }
-
-        context->currentCluster = bsi->rootCluster;
-        printf("Changed directory to parent: %s\n", context->path);
-        return;
+        fprintf(out, "\n");
     }
+}
 
-    //allocate memory for reeading cluster
-    unsigned char* buffer = malloc(bsi->bytesPerSector * bsi->sectorsPerCluster);
-    if (!buffer) {
-        printf("Failed to allocate memory\n");
+//stats command: print the table, or clear it with "stats reset"
+void showStats(const char* args) {
+    if (strcmp(args, "reset") == 0) {
+        memset(commandStats, 0, sizeof(commandStats));
+        status("Statistics reset\n");
         return;
     }
+    printStats(output());
+}
 
-    //if you cannot read from the cluster, free the buffer and exit the fucntion
-    if (!readCluster(fd, context->currentCluster, buffer, bsi)) {
-        free(buffer);
-        return;
-    }
+//per-session scratch arena: commands take cluster buffers and staging buffers from it
+//with a pointer bump, and main resets it after every command
+typedef struct {
+    unsigned char* base;
+    size_t size;
+    size_t used;
+} Arena;
 
-    //initialize entry pointer
-    DirEntry* entry = (DirEntry*)buffer;
-    int entriesCount = (bsi->bytesPerSector * bsi->sectorsPerCluster) / sizeof(DirEntry);
-    bool found = false;
+__thread Arena scratchArena = {NULL, 0, 0};
 
-    //loop through direectory entries
-    for (int i = 0; i < entriesCount; i++, entry++) {
-        //error handling
-        if (entry->name[0] == 0x00) {
-            printf("Reached end of directory entries.\n");
-            break; 
-        }
-        if ((unsigned char)entry->name[0] == 0xE5) {
-            printf("Skipped a deleted entry.\n");
-            continue; 
-        }
+bool arenaInit(size_t size) {
+    scratchArena.base = malloc(size);
+    if (!scratchArena.base) {
+        reply("Failed to allocate memory for scratch arena\n");
+        return false;
+    }
+    scratchArena.size = size;
+    scratchArena.used = 0;
+    return true;
+}
 
-        //format the name of the directory
-        char formattedName[12];
-        strncpy(formattedName, entry->name, 11);
-        formattedName[11] = '\0';
+//16-byte aligned block that lives until the next arenaReset, NULL when the arena is exhausted
+void* arenaAlloc(size_t size) {
+    size_t aligned = (size + 15) & ~(size_t)15;
+    if (aligned > scratchArena.size - scratchArena.used) {
+        reply("Error: Scratch arena exhausted (%zu bytes requested)\n", size);
+        return NULL;
+    }
+    void* block = scratchArena.base + scratchArena.used;
+    scratchArena.used += aligned;
+    return block;
+}
 
-        for (int j = 10; j >= 0; j--) {
-            if (formattedName[j] == ' ') formattedName[j] = '\0';
-            else break;
-        }
+void arenaReset() {
+    scratchArena.used = 0;
+}
 
-        if ((entry->attr & ATTR_DIRECTORY) && strcmp(formattedName, dirName) == 0) {
-            unsigned int newCluster = (entry->firstClusterHigh << 16) | entry->firstClusterLow;
-            if (newCluster == 0) newCluster = bsi->rootCluster; 
+void arenaFree() {
+    free(scratchArena.base);
+    scratchArena.base = NULL;
+    scratchArena.size = scratchArena.used = 0;
+}
 
-            //update the path and the current cluster
-            char newPath[512];
-            if (snprintf(newPath, sizeof(newPath), "%s/%s", context->path, dirName) >= (int)sizeof(newPath)) {
-                printf("Error: New path too long\n");
-                free(buffer);
-                return;
-            }
-            strncpy(context->path, newPath, sizeof(context->path));
-            context->path[sizeof(context->path) - 1] = '\0'; 
+//image backend, chosen in main: plain pread/pwrite on the fd, or a shared
+//mapping of the whole image so cluster and FAT access is pointer arithmetic
+typedef struct {
+    unsigned char* map;   //NULL when using pread/pwrite
+    size_t size;
+} ImageBackend;
 
-            context->currentCluster = newCluster;
-            found = true;
-            printf("Changed directory to %s\n", dirName);
-            break;
-        }
-    }
+ImageBackend image = {NULL, 0};
 
-    //if directory is not found, print error message 
-    if (!found) {
-        printf("Directory not found: %s\n", dirName);
+//map the whole image read/write, returns false if mmap is not possible
+bool mapImage(int fd, unsigned long long size) {
+    if (size == 0) {
+        return false;
     }
-
-    free(buffer);
+    void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("Error mapping image");
+        return false;
+    }
+    image.map = map;
+    image.size = size;
+    return true;
 }
 
-//info function
-void printBootSectorInfo(const char *imagePath) {
-    //open the image with correct permissions
-    int fd = open(imagePath, O_RDONLY);
-    if (fd < 0) {
-        perror("Failed to open image file");
-        return;
+void unmapImage() {
+    if (image.map) {
+        msync(image.map, image.size, MS_SYNC);
+        munmap(image.map, image.size);
+        image.map = NULL;
+        image.size = 0;
     }
+}
 
-    //read the boot sector and print an error message if failed
-    unsigned char bootSector[512];
-    if (read(fd, bootSector, sizeof(bootSector)) != sizeof(bootSector)) {
-        perror("Failed to read boot sector");
-        close(fd);
-        return;
+//pointer into the mapping for [offset, offset+len), NULL if not mapped or out of range
+unsigned char* imagePtr(off_t offset, size_t len) {
+    if (!image.map || offset < 0 || (size_t)offset + len > image.size) {
+        return NULL;
     }
+    return image.map + offset;
+}
 
-    //print the size of the image file
-    struct stat st;
-    if (fstat(fd, &st) != 0) {
-        perror("Failed to get image file size");
-        close(fd);
-        return;
-    }
+//copy-on-write overlay, chosen with -o in main: the image is opened read-only and every write
+//lands in a sparse delta file at the same offset, one bit per cluster-sized block says which
+//blocks the delta holds; the map is kept after the image-sized data region of the delta
+typedef struct {
+    int fd;                     //-1 when writes go straight to the image
+    uint64_t* present;
+    size_t blocks;
+    unsigned int blockSize;
+    unsigned long long imageSize;
+    off_t mapOffset;            //where the header and map start in the delta file
+    bool mapDirty;
+    pthread_mutex_t copyLock;   //one copy-up at a time, for import's worker threads
+} Overlay;
 
-    //populate all values for an instance of BootSectorInfo
-    BootSectorInfo info = {
-        .bytesPerSector = *(unsigned short *)(bootSector + 11),
-        .sectorsPerCluster = *(bootSector + 13),
-        .rootCluster = *(unsigned int *)(bootSector + 44),
-        .sectorsPerFAT = *(unsigned int *)(bootSector + 36),
-        .sizeOfImage = st.st_size
-    };
-    info.totalClusters = (st.st_size / (info.sectorsPerCluster * info.bytesPerSector));
+typedef struct {
+    char magic[8];
+    uint64_t imageSize;
+    uint32_t blockSize;
+    uint32_t reserved;
+} OverlayHeader;
 
-    //print all data values
-    printf("Bytes Per Sector: %u\n", info.bytesPerSector);
-    printf("Sectors Per Cluster: %u\n", info.sectorsPerCluster);
-    printf("Root Cluster: %u\n", info.rootCluster);
-    printf("Total # of Clusters in Data Region: %u\n", info.totalClusters);
-    printf("# of Entries in One FAT: %u\n", info.sectorsPerFAT);
-    printf("Size of Image (in bytes): %llu\n", info.sizeOfImage);
+const char* overlayPath = NULL;
+Overlay overlay = {-1, NULL, 0, 0, 0, 0, false, PTHREAD_MUTEX_INITIALIZER};
 
-    close(fd);
+static bool overlayHas(size_t block) {
+    return (__atomic_load_n(&overlay.present[block / 64], __ATOMIC_ACQUIRE) >> (block % 64)) & 1;
 }
 
-//fucntion to handle ls command
-void listDirectory(int fd, DirectoryContext* context, BootSectorInfo* bsi) {
-    //like all functions, allocate memeory to read from the cluster
-    unsigned char* buffer = malloc(bsi->bytesPerSector * bsi->sectorsPerCluster);
-    if (!buffer) {
-        printf("Failed to allocate memory for reading cluster\n");
-        return;
-    }
-    //if failed, clear the buffer and exit
-    if (!readCluster(fd, context->currentCluster, buffer, bsi)) {
-        free(buffer);
-        return;
-    }
-
-    //initialize entry buffer and print '.' and '..'
-    DirEntry* entry = (DirEntry*) buffer;
-    int entriesCount = (bsi->bytesPerSector * bsi->sectorsPerCluster) / DIR_ENTRY_SIZE;
-    printf(".\n..\n"); 
+static void overlayMark(size_t block) {
+    __atomic_fetch_or(&overlay.present[block / 64], (uint64_t)1 << (block % 64), __ATOMIC_RELEASE);
+    __atomic_store_n(&overlay.mapDirty, true, __ATOMIC_RELAXED);
+}
 
-    //print all entries unless it was deleted
-    for (int i = 0; i < entriesCount; i++, entry++) {
-        if (entry->name[0] == 0x00) break; 
-        if ((unsigned char)entry->name[0] == 0xE5) continue;
+//pread or pwrite all of len, counting each call
+static bool overlayTransfer(int fd, bool write, void* buffer, size_t len, off_t offset, unsigned long long* syscalls) {
+    size_t done = 0;
+    while (done < len) {
+        (*syscalls)++;
+        ssize_t n = write ? pwrite(fd, (unsigned char*)buffer + done, len - done, offset + done)
+                          : pread(fd, (unsigned char*)buffer + done, len - done, offset + done);
+        if (n < 0) {
+            perror(write ? "Error writing overlay" : "Error reading image");
+            return false;
+        }
+        if (n == 0) {
+            fprintf(stderr, "Read past end of image at offset %lld\n", (long long)(offset + done));
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
 
-        printf("%.11s\n", entry->name); 
+//read through the overlay: each run of blocks comes from the delta or the image, whichever has it
+static bool overlayRead(int fd, void* buffer, size_t len, off_t offset, unsigned long long* syscalls) {
+    size_t done = 0;
+    while (done < len) {
+        size_t block = (offset + done) / overlay.blockSize;
+        bool inDelta = block < overlay.blocks && overlayHas(block);
+        size_t run = (block + 1) * (size_t)overlay.blockSize - (offset + done);
+        while (done + run < len && block + 1 < overlay.blocks && overlayHas(block + 1) == inDelta) {
+            block++;
+            run += overlay.blockSize;
+        }
+        if (run > len - done) run = len - done;
+        if (!overlayTransfer(inDelta ? overlay.fd : fd, false, (unsigned char*)buffer + done, run, offset + done, syscalls)) {
+            return false;
+        }
+        done += run;
     }
-    free(buffer);
+    return true;
 }
 
-//function to handle mkdir 
-void createDirectory(int fd, const char* dirName, DirectoryContext* context, BootSectorInfo* bsi) {
-    unsigned char* buffer = malloc(bsi->bytesPerSector * bsi->sectorsPerCluster);
-    if (!buffer) {
-        printf("Failed to allocate memory for directory cluster\n");
-        return;
+//write into the delta, first copying up the image's version of blocks that are only partly overwritten
+static bool overlayWrite(int fd, const void* buffer, size_t len, off_t offset, unsigned long long* syscalls) {
+    if ((unsigned long long)offset + len > overlay.imageSize) {
+        fprintf(stderr, "Write past end of image at offset %lld\n", (long long)offset);
+        return false;
     }
-    if (!readCluster(fd, context->currentCluster, buffer, bsi)) {
-        free(buffer);
-        return;
+    size_t firstBlock = offset / overlay.blockSize;
+    size_t lastBlock = (offset + len - 1) / overlay.blockSize;
+    for (size_t block = firstBlock; block <= lastBlock; block++) {
+        off_t blockStart = (off_t)block * overlay.blockSize;
+        size_t blockLen = overlay.imageSize - blockStart < overlay.blockSize ? overlay.imageSize - blockStart : overlay.blockSize;
+        bool whole = offset <= blockStart && (unsigned long long)offset + len >= (unsigned long long)blockStart + blockLen;
+        if (whole || overlayHas(block)) {
+            continue;
+        }
+        pthread_mutex_lock(&overlay.copyLock);
+        bool ok = true;
+        if (!overlayHas(block)) {
+            unsigned char* copy = malloc(blockLen);
+            ok = copy && overlayTransfer(fd, false, copy, blockLen, blockStart, syscalls) &&
+                 overlayTransfer(overlay.fd, true, copy, blockLen, blockStart, syscalls);
+            if (ok) overlayMark(block);
+            free(copy);
+        }
+        pthread_mutex_unlock(&overlay.copyLock);
+        if (!ok) {
+            return false;
+        }
+    }
+    if (!overlayTransfer(overlay.fd, true, (void*)buffer, len, offset, syscalls)) {
+        return false;
     }
+    for (size_t block = firstBlock; block <= lastBlock; block++) {
+        overlayMark(block);
+    }
+    return true;
+}
 
-    DirEntry* entries = (DirEntry*) buffer;
-    int numEntries = (bsi->bytesPerSector * bsi->sectorsPerCluster) / sizeof(DirEntry);
-    bool foundSpace = false;
+//write the header and block map behind the data region
+static bool overlaySaveMap(unsigned long long* syscalls) {
+    if (!overlay.mapDirty) {
+        return true;
+    }
+    OverlayHeader header = {"FATOVL1", overlay.imageSize, overlay.blockSize, 0};
+    overlay.mapDirty = false;
+    if (!overlayTransfer(overlay.fd, true, &header, sizeof(header), overlay.mapOffset, syscalls) ||
+        !overlayTransfer(overlay.fd, true, overlay.present, (overlay.blocks + 63) / 64 * sizeof(uint64_t),
+                         overlay.mapOffset + sizeof(header), syscalls)) {
+        overlay.mapDirty = true;
+        return false;
+    }
+    return true;
+}
 
-    //search for a free entry
-    for (int i = 0; i < numEntries; i++) {
-        if (entries[i].name[0] == 0x00 || (unsigned char)entries[i].name[0] == 0xE5) { 
-            memset(&entries[i], 0, sizeof(DirEntry)); 
-            strncpy(entries[i].name, dirName, 11); 
-            entries[i].attr = ATTR_DIRECTORY;
-
-            // Assign a new cluster for the directory different from the current one
-            entries[i].firstClusterLow = context->currentCluster + 1; 
-            entries[i].firstClusterHigh = 0;
-            entries[i].fileSize = 0; 
-
-            foundSpace = true;
-            break;
-        }
+//open or create the delta for an image of imageSize bytes, resuming the map a previous run saved
+bool overlayOpen(const char* path, unsigned long long imageSize, unsigned int blockSize) {
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        perror("Error opening overlay");
+        return false;
+    }
+    overlay.fd = fd;
+    overlay.imageSize = imageSize;
+    overlay.blockSize = blockSize;
+    overlay.blocks = (imageSize + blockSize - 1) / blockSize;
+    overlay.mapOffset = (off_t)((imageSize + 4095) & ~4095ULL);
+    overlay.present = calloc((overlay.blocks + 63) / 64, sizeof(uint64_t));
+    if (!overlay.present) {
+        printf("Failed to allocate memory for the overlay map\n");
+        close(fd);
+        overlay.fd = -1;
+        return false;
     }
 
-    //if the directory is full, print error. if it is created successfully, print a success message
-    if (!foundSpace) {
-        printf("No space in current directory to create new directory\n");
-    } else {
-        off_t offset = (context->currentCluster - 2) * bsi->sectorsPerCluster * bsi->bytesPerSector + bsi->rootCluster * bsi->bytesPerSector;
-        if (lseek(fd, offset, SEEK_SET) < 0) {
-            perror("Error seeking to write new directory entry");
-        } else if (write(fd, buffer, bsi->bytesPerSector * bsi->sectorsPerCluster) < 0) {
-            perror("Error writing new directory entry");
-        } else {
-            printf("Directory created successfully\n");
+    unsigned long long syscalls = 0;
+    OverlayHeader header;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        if (!overlayTransfer(fd, false, &header, sizeof(header), overlay.mapOffset, &syscalls) ||
+            memcmp(header.magic, "FATOVL1", 8) != 0 || header.imageSize != imageSize || header.blockSize != blockSize ||
+            !overlayTransfer(fd, false, overlay.present, (overlay.blocks + 63) / 64 * sizeof(uint64_t),
+                             overlay.mapOffset + sizeof(header), &syscalls)) {
+            printf("Error: %s is not an overlay of this image\n", path);
+            free(overlay.present);
+            overlay.present = NULL;
+            close(fd);
+            overlay.fd = -1;
+            return false;
         }
+        return true;
     }
+    //a new delta is a hole the size of the image followed by an empty map
+    overlay.mapDirty = true;
+    if (ftruncate(fd, overlay.mapOffset) < 0 || !overlaySaveMap(&syscalls)) {
+        perror("Error creating overlay");
+        free(overlay.present);
+        overlay.present = NULL;
+        close(fd);
+        overlay.fd = -1;
+        return false;
+    }
+    return true;
+}
 
-    free(buffer);
+//save the map and make the delta durable
+bool overlaySync(unsigned long long* syscalls) {
+    bool ok = overlaySaveMap(syscalls);
+    (*syscalls)++;
+    if (fdatasync(overlay.fd) < 0) {
+        perror("Error syncing overlay");
+        ok = false;
+    }
+    return ok;
 }
 
-//function to handle the creation of the file
-void createFile(int fd, const char* fileName, DirectoryContext* context, BootSectorInfo* bsi) {
-    unsigned char* buffer = malloc(bsi->bytesPerSector * bsi->sectorsPerCluster);
-    if (!buffer) {
-        printf("Failed to allocate memory for directory cluster\n");
-        return;
+//forget every block in the delta, punching its data out of the file
+bool overlayReset(unsigned long long* syscalls) {
+    memset(overlay.present, 0, (overlay.blocks + 63) / 64 * sizeof(uint64_t));
+    overlay.mapDirty = true;
+    (*syscalls) += 2;
+    if (ftruncate(overlay.fd, 0) < 0 || ftruncate(overlay.fd, overlay.mapOffset) < 0) {
+        perror("Error resetting overlay");
+        return false;
     }
-    if (!readCluster(fd, context->currentCluster, buffer, bsi)) {
-        free(buffer);
+    return overlaySync(syscalls);
+}
+
+void overlayClose() {
+    if (overlay.fd < 0) {
         return;
     }
+    unsigned long long syscalls = 0;
+    overlaySaveMap(&syscalls);
+    close(overlay.fd);
+    free(overlay.present);
+    overlay.present = NULL;
+    overlay.fd = -1;
+}
 
-    DirEntry* entries = (DirEntry*) buffer;
-    int numEntries = (bsi->bytesPerSector * bsi->sectorsPerCluster) / sizeof(DirEntry);
-    bool foundSpace = false;
-    bool exists = false;
-
-    //search for a free entry, similar to mkdir
-    for (int i = 0; i < numEntries; i++) {
-        if (entries[i].name[0] == 0x00 || (unsigned char)entries[i].name[0] == 0xE5) {
-            if (!foundSpace) {
-                foundSpace = true;
-                memset(&entries[i], 0, sizeof(DirEntry)); 
-                strncpy(entries[i].name, fileName, 11); 
-                entries[i].attr = 0x00; //file attribute
-                entries[i].firstClusterLow = 0; 
-                entries[i].firstClusterHigh = 0;
-                entries[i].fileSize = 0; 
-            }
-        } else {
-            char formattedName[12];
-            strncpy(formattedName, entries[i].name, 11);
-            formattedName[11] = '\0';
-
-            for (int j = 10; j >= 0; j--) {
-                if (formattedName[j] == ' ') formattedName[j] = '\0';
-                else break;
-            }
-
-            if (strcmp(formattedName, fileName) == 0) {
-                printf("Error: A file or directory with this name already exists.\n");
-                exists = true;
-                break;
-            }
+//read len bytes at offset from whichever backend is active
+bool imageRead(int fd, void* buffer, size_t len, off_t offset) {
+    if (image.map) {
+        unsigned char* src = imagePtr(offset, len);
+        if (!src) {
+            fprintf(stderr, "Read past end of image at offset %lld\n", (long long)offset);
+            return false;
         }
+        memcpy(buffer, src, len);
+        activeStats->bytesRead += len;
+        return true;
     }
-
-    //Calculate the offset where this directory's data begins in the disk image
-    if (foundSpace && !exists) {
-        unsigned long long sector = ((context->currentCluster - 2) * bsi->sectorsPerCluster) + bsi->rootCluster;
-        off_t offset = sector * bsi->bytesPerSector;
-        if (lseek(fd, offset, SEEK_SET) < 0) {
-            perror("Error seeking to write new file entry");
-        } else if (write(fd, buffer, bsi->bytesPerSector * bsi->sectorsPerCluster) < 0) {
-            perror("Error writing new file entry");
-        } else {
-            printf("File created successfully\n");
+    if (overlay.fd >= 0) {
+        if (!overlayRead(fd, buffer, len, offset, &activeStats->syscalls)) {
+            return false;
         }
+        activeStats->bytesRead += len;
+        return true;
     }
 
-    free(buffer);
+    size_t done = 0;
+    while (done < len) {
+        activeStats->syscalls++;
+        ssize_t n = pread(fd, (unsigned char*)buffer + done, len - done, offset + done);
+        if (n < 0) {
+            perror("Error reading image");
+            return false;
+        }
+        if (n == 0) {
+            fprintf(stderr, "Read past end of image at offset %lld\n", (long long)(offset + done));
+            return false;
+        }
+        done += n;
+    }
+    activeStats->bytesRead += len;
+    return true;
 }
 
-//function to handle rm
-void removeFile(int fd, const char* fileName, DirectoryContext* context, BootSectorInfo* bsi) {
-    unsigned char* buffer = malloc(bsi->bytesPerSector * bsi->sectorsPerCluster);
-    if (!buffer) {
-        printf("Failed to allocate memory for directory cluster\n");
-        return;
+//thread safe read for worker threads, bypasses the caches and the per-command counters
+//(callers add their syscall count to the stats once they have joined)
+bool imageReadShared(int fd, void* buffer, size_t len, off_t offset, unsigned long long* syscalls) {
+    unsigned char* src = imagePtr(offset, len);
+    if (src) {
+        memcpy(buffer, src, len);
+        return true;
     }
-    if (!readCluster(fd, context->currentCluster, buffer, bsi)) {
-        free(buffer);
-        return;
+    if (overlay.fd >= 0) {
+        return overlayRead(fd, buffer, len, offset, syscalls);
     }
-
-    DirEntry* entries = (DirEntry*) buffer;
-    int numEntries = (bsi->bytesPerSector * bsi->sectorsPerCluster) / sizeof(DirEntry);
-    bool fileFound = false;
-
-    //search for entry to delete
-    for (int i = 0; i < numEntries; i++) {
-        if (entries[i].name[0] == 0x00) {
-            break; 
+    size_t done = 0;
+    while (done < len) {
+        (*syscalls)++;
+        ssize_t n = pread(fd, (unsigned char*)buffer + done, len - done, offset + done);
+        if (n <= 0) {
+            if (n < 0) perror("Error reading image");
+            return false;
         }
+        done += n;
+    }
+    return true;
+}
 
-        if ((unsigned char)entries[i].name[0] == 0xE5) {
-            continue; 
+//write len bytes at offset to whichever backend is active
+bool imageWrite(int fd, const void* buffer, size_t len, off_t offset) {
+    if (image.map) {
+        unsigned char* dst = imagePtr(offset, len);
+        if (!dst) {
+            fprintf(stderr, "Write past end of image at offset %lld\n", (long long)offset);
+            return false;
         }
-
-        char formattedName[12];
-        strncpy(formattedName, entries[i].name, 11);
-        formattedName[11] = '\0';
-
-        //remove trailing spaces from filename
-        for (int j = 10; j >= 0; j--) {
-            if (formattedName[j] == ' ') formattedName[j] = '\0';
-            else break;
+        memcpy(dst, buffer, len);
+        activeStats->bytesWritten += len;
+        return true;
+    }
+    if (overlay.fd >= 0) {
+        if (!overlayWrite(fd, buffer, len, offset, &activeStats->syscalls)) {
+            return false;
         }
+        activeStats->bytesWritten += len;
+        return true;
+    }
 
-        //mark the deleted entry as deleted
-        if (strcmp(formattedName, fileName) == 0) {
-            entries[i].name[0] = 0xE5; 
-            fileFound = true;
-            break;
+    size_t done = 0;
+    while (done < len) {
+        activeStats->syscalls++;
+        ssize_t n = pwrite(fd, (const unsigned char*)buffer + done, len - done, offset + done);
+        if (n < 0) {
+            perror("Error writing image");
+            return false;
         }
+        done += n;
     }
+    activeStats->bytesWritten += len;
+    return true;
+}
 
-    //if the file is found, calculate offset and print message
-    if (fileFound) {
-        off_t offset = (context->currentCluster - 2) * bsi->sectorsPerCluster * bsi->bytesPerSector + bsi->rootCluster * bsi->bytesPerSector;
-        if (lseek(fd, offset, SEEK_SET) < 0) {
-            perror("Error seeking to update directory entry");
-        } else if (write(fd, buffer, bsi->bytesPerSector * bsi->sectorsPerCluster) < 0) {
-            perror("Error writing updated directory entry");
-        } else {
-            printf("File removed successfully\n");
+//thread safe counterpart of imageWrite for worker threads
+bool imageWriteShared(int fd, const void* buffer, size_t len, off_t offset, unsigned long long* syscalls) {
+    unsigned char* dst = imagePtr(offset, len);
+    if (dst) {
+        memcpy(dst, buffer, len);
+        return true;
+    }
+    if (image.map) {
+        fprintf(stderr, "Write past end of image at offset %lld\n", (long long)offset);
+        return false;
+    }
+    if (overlay.fd >= 0) {
+        return overlayWrite(fd, buffer, len, offset, syscalls);
+    }
+    size_t done = 0;
+    while (done < len) {
+        (*syscalls)++;
+        ssize_t n = pwrite(fd, (const unsigned char*)buffer + done, len - done, offset + done);
+        if (n < 0) {
+            perror("Error writing image");
+            return false;
         }
-    } else {
-        printf("Error: File not found.\n");
+        done += n;
     }
-
-    free(buffer);
+    return true;
 }
 
-//function to handle rmdir
-void removeDirectory(int fd, const char* dirName, DirectoryContext* context, BootSectorInfo* bsi) {
-    if (strcmp(dirName, ".") == 0 || strcmp(dirName, "..") == 0) {
-        printf("Error: Cannot remove '.' or '..'\n");
+//flush a written range back to the image file (msync on the touched pages when mapped)
+void imageSync(off_t offset, size_t len) {
+    if (!image.map || len == 0) {
         return;
     }
-    unsigned char* buffer = malloc(bsi->bytesPerSector * bsi->sectorsPerCluster);
-    if (!buffer) {
-        printf("Failed to allocate memory for directory cluster\n");
-        return;
+    long pageSize = sysconf(_SC_PAGESIZE);
+    off_t start = offset & ~((off_t)pageSize - 1);
+    activeStats->syscalls++;
+    if (msync(image.map + start, len + (offset - start), MS_ASYNC) < 0) {
+        perror("Error syncing image");
     }
-    if (!readCluster(fd, context->currentCluster, buffer, bsi)) {
-        free(buffer);
+}
+
+//ask the kernel to start fetching a range that is about to be read
+void imagePrefetch(int fd, off_t offset, size_t len) {
+    if (len == 0) {
         return;
     }
-
-    DirEntry* entries = (DirEntry*)buffer;
-    int numEntries = (bsi->bytesPerSector * bsi->sectorsPerCluster) / sizeof(DirEntry);
-    bool found = false;
-    bool isEmpty = true;
-
-    //search for directory with formatted name, ignore deleted directories
-    for (int i = 0; i < numEntries; i++) {
-        if (entries[i].name[0] == 0x00) {
-            break; 
-        }
-        if ((unsigned char)entries[i].name[0] == 0xE5) {
-            continue; 
+    activeStats->syscalls++;
+    if (image.map) {
+        long pageSize = sysconf(_SC_PAGESIZE);
+        off_t start = offset & ~((off_t)pageSize - 1);
+        if ((size_t)start < image.size) {
+            size_t span = len + (offset - start);
+            if (start + span > image.size) span = image.size - start;
+            madvise(image.map + start, span, MADV_WILLNEED);
         }
-        char formattedName[12];
-        strncpy(formattedName, entries[i].name, 11);
-        formattedName[11] = '\0';
+    } else {
+        posix_fadvise(fd, offset, len, POSIX_FADV_WILLNEED);
+    }
+}
 
-        //remove trailing spaces from filename
-        for (int j = 10; j >= 0; j--) {
-            if (formattedName[j] == ' ') formattedName[j] = '\0';
-            else break;
-        }
+//asynchronous engine for bulk transfers: callers queue every run of a transfer in a batch,
+//which goes to an io_uring (set up with raw syscalls, one ring per thread) with up to
+//ioQueueDepth requests in flight; without io_uring, or with -q 0, it falls back to pread/pwrite
+unsigned int ioQueueDepth = IO_QUEUE_DEPTH;
 
-        if (strcmp(formattedName, dirName) == 0 && (entries[i].attr & ATTR_DIRECTORY)) {
-            found = true;
+typedef struct {
+    unsigned char* buffer;
+    size_t len;
+    off_t offset;
+} IoRequest;
 
-            //check if the directory is empty by attempting to read its cluster
-            unsigned int dirCluster = (entries[i].firstClusterHigh << 16) | entries[i].firstClusterLow;
-            unsigned char* dirBuffer = malloc(bsi->bytesPerSector * bsi->sectorsPerCluster);
-            if (!dirBuffer || !readCluster(fd, dirCluster, dirBuffer, bsi)) {
-                isEmpty = false; 
-            } else {
-                DirEntry* dirEntries = (DirEntry*)dirBuffer;
-                for (int j = 0; j < numEntries; j++) {
-                    if (dirEntries[j].name[0] == 0x00) {
-                        break; 
-                    }
-                    if ((unsigned char)dirEntries[j].name[0] == 0xE5) {
-                        continue; 
-                    }
-                    if (j > 1) { 
-                        isEmpty = false;
-                        break;
-                    }
+typedef struct {
+    int fd;
+    bool write;
+    unsigned int count;
+    unsigned long long* syscalls;
+    IoRequest requests[IO_BATCH_MAX];
+} IoBatch;
+
+#ifdef HAVE_IO_URING
+typedef struct {
+    int fd;                     //-1 until the thread's first transfer
+    unsigned int entries;
+    unsigned char* sqMap;
+    size_t sqMapSize;
+    unsigned char* cqMap;       //same mapping as sqMap when the kernel has IORING_FEAT_SINGLE_MMAP
+    size_t cqMapSize;
+    struct io_uring_sqe* sqes;
+    size_t sqesSize;
+    unsigned int* sqTail;
+    unsigned int* sqMask;
+    unsigned int* sqArray;
+    unsigned int* cqHead;
+    unsigned int* cqTail;
+    unsigned int* cqMask;
+    struct io_uring_cqe* cqes;
+} IoRing;
+
+__thread IoRing ioRing = {.fd = -1};
+__thread bool ioRingFailed = false;
+
+//read-ahead has its own ring: its requests stay in flight across commands
+__thread IoRing readAheadRing = {.fd = -1};
+__thread bool readAheadRingFailed = false;
+__thread unsigned int readAheadInFlight = 0;
+
+static bool ioRingSetup(IoRing* ring, unsigned int entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) {
+        return false;
+    }
+
+    ring->sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && ring->cqMapSize > ring->sqMapSize) {
+        ring->sqMapSize = ring->cqMapSize;
+    }
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    void* sq = mmap(NULL, ring->sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    void* cq = single ? sq : mmap(NULL, ring->cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    void* sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+        if (sqes != MAP_FAILED) munmap(sqes, ring->sqesSize);
+        if (cq != MAP_FAILED && cq != sq) munmap(cq, ring->cqMapSize);
+        if (sq != MAP_FAILED) munmap(sq, ring->sqMapSize);
+        close(fd);
+        return false;
+    }
+
+    ring->sqMap = sq;
+    ring->cqMap = cq;
+    ring->sqes = sqes;
+    ring->sqTail = (unsigned int*)(ring->sqMap + params.sq_off.tail);
+    ring->sqMask = (unsigned int*)(ring->sqMap + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned int*)(ring->sqMap + params.sq_off.array);
+    ring->cqHead = (unsigned int*)(ring->cqMap + params.cq_off.head);
+    ring->cqTail = (unsigned int*)(ring->cqMap + params.cq_off.tail);
+    ring->cqMask = (unsigned int*)(ring->cqMap + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(ring->cqMap + params.cq_off.cqes);
+    ring->entries = params.sq_entries;
+    ring->fd = fd;
+    return true;
+}
+
+//this thread's ring, set up on first use, NULL when transfers should use pread/pwrite
+static IoRing* ioRingGet() {
+    //ring requests go straight to the fd, past the overlay
+    if (ioQueueDepth == 0 || ioRingFailed || image.map || overlay.fd >= 0) {
+        return NULL;
+    }
+    if (ioRing.fd < 0 && !ioRingSetup(&ioRing, ioQueueDepth)) {
+        ioRingFailed = true;
+        return NULL;
+    }
+    return &ioRing;
+}
+
+//keep up to ioQueueDepth requests in flight until the batch has been submitted and reaped
+//completed bytes are consumed from each request, short or failed requests are left over
+//for the synchronous path, which retries them and reports the error
+static bool ioRingRun(IoRing* ring, IoBatch* batch) {
+    unsigned int depth = ioQueueDepth < ring->entries ? ioQueueDepth : ring->entries;
+    unsigned int next = 0, inFlight = 0, unsubmitted = 0;
+    while (next < batch->count || inFlight > 0) {
+        unsigned int tail = *ring->sqTail;
+        while (next < batch->count && inFlight < depth) {
+            IoRequest* req = &batch->requests[next];
+            unsigned int slot = tail & *ring->sqMask;
+            struct io_uring_sqe* sqe = &ring->sqes[slot];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = batch->write ? IORING_OP_WRITE : IORING_OP_READ;
+            sqe->fd = batch->fd;
+            sqe->addr = (unsigned long)req->buffer;
+            sqe->len = req->len;
+            sqe->off = req->offset;
+            sqe->user_data = next;
+            ring->sqArray[slot] = slot;
+            tail++;
+            next++;
+            inFlight++;
+            unsubmitted++;
+        }
+        __atomic_store_n(ring->sqTail, tail, __ATOMIC_RELEASE);
+
+        //refill as soon as one request completes, once everything is queued wait for the rest in one call
+        unsigned int wait = next < batch->count ? 1 : inFlight;
+        (*batch->syscalls)++;
+        int submitted = syscall(__NR_io_uring_enter, ring->fd, unsubmitted, wait, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (submitted < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error submitting image I/O");
+            return false;
+        }
+        unsubmitted -= submitted;
+
+        unsigned int head = *ring->cqHead;
+        while (head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cqMask];
+            IoRequest* req = &batch->requests[cqe->user_data];
+            if (cqe->res > 0) {
+                req->buffer += cqe->res;
+                req->offset += cqe->res;
+                req->len -= cqe->res;
+            }
+            head++;
+            inFlight--;
+        }
+        __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+    }
+    return true;
+}
+
+static void ioRingRelease(IoRing* ring) {
+    if (ring->fd < 0) {
+        return;
+    }
+    munmap(ring->sqes, ring->sqesSize);
+    if (ring->cqMap != ring->sqMap) {
+        munmap(ring->cqMap, ring->cqMapSize);
+    }
+    munmap(ring->sqMap, ring->sqMapSize);
+    close(ring->fd);
+    ring->fd = -1;
+}
+#endif
+
+//release this thread's rings, called by every thread that ran transfers before it exits
+//(open files must be closed first so no read-ahead is in flight)
+void ioRingFree() {
+#ifdef HAVE_IO_URING
+    ioRingRelease(&ioRing);
+    ioRingRelease(&readAheadRing);
+    readAheadInFlight = 0;
+#endif
+}
+
+//name of the engine bulk transfers use, for the export and import summaries
+const char* ioEngineName() {
+    if (image.map) {
+        return "mmap";
+    }
+    return ioQueueDepth ? "io_uring" : "pread/pwrite";
+}
+
+void ioBatchInit(IoBatch* batch, int fd, bool write, unsigned long long* syscalls) {
+    batch->fd = fd;
+    batch->write = write;
+    batch->count = 0;
+    batch->syscalls = syscalls;
+}
+
+//run every queued request and wait for all of them, the batch is empty afterwards
+bool ioBatchSubmit(IoBatch* batch) {
+#ifdef HAVE_IO_URING
+    IoRing* ring = ioRingGet();
+    if (ring && !ioRingRun(ring, batch)) {
+        //requests may still be in flight, so none of them can be retried here
+        ioRingRelease(&ioRing);
+        ioRingFailed = true;
+        batch->count = 0;
+        return false;
+    }
+#endif
+    bool ok = true;
+    for (unsigned int i = 0; i < batch->count && ok; i++) {
+        IoRequest* req = &batch->requests[i];
+        if (req->len == 0) {
+            continue;
+        }
+        ok = batch->write ? imageWriteShared(batch->fd, req->buffer, req->len, req->offset, batch->syscalls)
+                          : imageReadShared(batch->fd, req->buffer, req->len, req->offset, batch->syscalls);
+    }
+    batch->count = 0;
+    return ok;
+}
+
+//queue len bytes at offset, submitting first if the batch is full
+//on the ring, long runs are split so a contiguous transfer still has several requests in flight
+bool ioBatchAdd(IoBatch* batch, void* buffer, size_t len, off_t offset) {
+#ifdef HAVE_IO_URING
+    size_t segment = ioRingGet() ? IO_SEGMENT_SIZE : len;
+#else
+    size_t segment = len;
+#endif
+    while (len > 0) {
+        if (batch->count == IO_BATCH_MAX && !ioBatchSubmit(batch)) {
+            return false;
+        }
+        size_t piece = len < segment ? len : segment;
+        batch->requests[batch->count++] = (IoRequest){buffer, piece, offset};
+        buffer = (unsigned char*)buffer + piece;
+        offset += piece;
+        len -= piece;
+    }
+    return true;
+}
+
+//byte offset of a cluster in the data region
+off_t clusterOffset(unsigned int clusterNum, BootSectorInfo* bsi) {
+    unsigned long long sector = ((unsigned long long)(clusterNum - 2) * bsi->sectorsPerCluster) + bsi->firstDataSector;
+    return (off_t)(sector * bsi->bytesPerSector);
+}
+
+//shared cache of recently used clusters with CLOCK eviction
+//reads fill it, writes go through to the image and patch any cached copy
+typedef struct {
+    unsigned char* data;        //capacity slots of clusterSize bytes
+    unsigned int* clusters;     //cluster held by each slot, 0 when empty
+    bool* referenced;
+    int* buckets;
+    int* chain;
+    unsigned int bucketMask;
+    unsigned int capacity;
+    unsigned int clusterSize;
+    unsigned int hand;
+} ClusterCache;
+
+__thread ClusterCache clusterCache = {NULL, NULL, NULL, NULL, NULL, 0, 0, 0, 0};
+
+//capacity of 0 disables the cache
+bool clusterCacheInit(unsigned int capacity, BootSectorInfo* bsi) {
+    if (capacity == 0) {
+        return true;
+    }
+    unsigned int buckets = 16;
+    while (buckets < capacity) buckets <<= 1;
+
+    clusterCache.clusterSize = bsi->bytesPerSector * bsi->sectorsPerCluster;
+    clusterCache.capacity = capacity;
+    clusterCache.bucketMask = buckets - 1;
+    clusterCache.hand = 0;
+    clusterCache.data = malloc((size_t)capacity * clusterCache.clusterSize);
+    clusterCache.clusters = calloc(capacity, sizeof(unsigned int));
+    clusterCache.referenced = calloc(capacity, sizeof(bool));
+    clusterCache.buckets = malloc(buckets * sizeof(int));
+    clusterCache.chain = malloc(capacity * sizeof(int));
+    if (!clusterCache.data || !clusterCache.clusters || !clusterCache.referenced || !clusterCache.buckets || !clusterCache.chain) {
+        reply("Failed to allocate memory for cluster cache\n");
+        return false;
+    }
+    memset(clusterCache.buckets, 0xFF, buckets * sizeof(int));
+    return true;
+}
+
+void clusterCacheFree() {
+    free(clusterCache.data);
+    free(clusterCache.clusters);
+    free(clusterCache.referenced);
+    free(clusterCache.buckets);
+    free(clusterCache.chain);
+    memset(&clusterCache, 0, sizeof(ClusterCache));
+}
+
+//cached copy of a cluster, or NULL
+static unsigned char* clusterCacheLookup(unsigned int clusterNum) {
+    if (clusterCache.capacity == 0) {
+        return NULL;
+    }
+    int slot = clusterCache.buckets[(clusterNum * 2654435761u) & clusterCache.bucketMask];
+    while (slot != -1) {
+        if (clusterCache.clusters[slot] == clusterNum) {
+            clusterCache.referenced[slot] = true;
+            return clusterCache.data + (size_t)slot * clusterCache.clusterSize;
+        }
+        slot = clusterCache.chain[slot];
+    }
+    return NULL;
+}
+
+//take a slot for a cluster that is not cached yet, evicting with the clock hand when full
+static unsigned char* clusterCacheClaim(unsigned int clusterNum) {
+
+    //sweep until a slot that was not referenced since the last pass
+    while (clusterCache.clusters[clusterCache.hand] != 0 && clusterCache.referenced[clusterCache.hand]) {
+        clusterCache.referenced[clusterCache.hand] = false;
+        clusterCache.hand = (clusterCache.hand + 1) % clusterCache.capacity;
+    }
+    unsigned int slot = clusterCache.hand;
+    clusterCache.hand = (clusterCache.hand + 1) % clusterCache.capacity;
+
+    //unlink the old occupant
+    if (clusterCache.clusters[slot] != 0) {
+        int* link = &clusterCache.buckets[(clusterCache.clusters[slot] * 2654435761u) & clusterCache.bucketMask];
+        while (*link != (int)slot) link = &clusterCache.chain[*link];
+        *link = clusterCache.chain[slot];
+    }
+
+    unsigned int bucket = (clusterNum * 2654435761u) & clusterCache.bucketMask;
+    clusterCache.clusters[slot] = clusterNum;
+    clusterCache.referenced[slot] = true;
+    clusterCache.chain[slot] = clusterCache.buckets[bucket];
+    clusterCache.buckets[bucket] = slot;
+    return clusterCache.data + (size_t)slot * clusterCache.clusterSize;
+}
+
+//forget a cached cluster, e.g. when filling its slot failed
+static void clusterCacheDrop(unsigned int clusterNum) {
+    if (clusterCache.capacity == 0) {
+        return;
+    }
+    int* link = &clusterCache.buckets[(clusterNum * 2654435761u) & clusterCache.bucketMask];
+    while (*link != -1) {
+        int slot = *link;
+        if (clusterCache.clusters[slot] == clusterNum) {
+            *link = clusterCache.chain[slot];
+            clusterCache.clusters[slot] = 0;
+            clusterCache.referenced[slot] = false;
+            return;
+        }
+        link = &clusterCache.chain[slot];
+    }
+}
+
+//forget every cached cluster, e.g. after another session wrote to the image
+void clusterCacheClear() {
+    if (clusterCache.capacity == 0) {
+        return;
+    }
+    memset(clusterCache.clusters, 0, clusterCache.capacity * sizeof(unsigned int));
+    memset(clusterCache.referenced, 0, clusterCache.capacity * sizeof(bool));
+    memset(clusterCache.buckets, 0xFF, (clusterCache.bucketMask + 1) * sizeof(int));
+    clusterCache.hand = 0;
+}
+
+//store a full cluster in the cache
+static void clusterCacheInsert(unsigned int clusterNum, const unsigned char* buffer) {
+    if (clusterCache.capacity == 0) {
+        return;
+    }
+    unsigned char* cached = clusterCacheLookup(clusterNum);
+    if (!cached) {
+        cached = clusterCacheClaim(clusterNum);
+    }
+    memcpy(cached, buffer, clusterCache.clusterSize);
+}
+
+//keep a cached cluster in step with a partial write to it
+void clusterCachePatch(unsigned int clusterNum, unsigned int offsetInCluster, const void* data, size_t len) {
+    unsigned char* cached = clusterCacheLookup(clusterNum);
+    if (cached) {
+        memcpy(cached + offsetInCluster, data, len);
+    }
+}
+
+//read data from a cluster and load it into memory buffer
+bool readCluster(int fd, unsigned int clusterNum, unsigned char* buffer, BootSectorInfo* bsi) {
+    if (clusterNum < 2) {
+        fprintf(stderr, "Invalid cluster number: %u\n", clusterNum);
+        return false;
+    }
+    size_t clusterSize = bsi->bytesPerSector * bsi->sectorsPerCluster;
+    activeStats->clusterReads++;
+    unsigned char* cached = clusterCacheLookup(clusterNum);
+    if (cached) {
+        activeStats->clusterCacheHits++;
+        memcpy(buffer, cached, clusterSize);
+        return true;
+    }
+    if (!imageRead(fd, buffer, clusterSize, clusterOffset(clusterNum, bsi))) {
+        return false;
+    }
+    clusterCacheInsert(clusterNum, buffer);
+    return true;
+}
+
+//write a full cluster buffer back to the image and flush it
+bool writeCluster(int fd, unsigned int clusterNum, const unsigned char* buffer, BootSectorInfo* bsi) {
+    if (clusterNum < 2) {
+        fprintf(stderr, "Invalid cluster number: %u\n", clusterNum);
+        return false;
+    }
+    size_t clusterSize = bsi->bytesPerSector * bsi->sectorsPerCluster;
+    off_t offset = clusterOffset(clusterNum, bsi);
+    if (!imageWrite(fd, buffer, clusterSize, offset)) {
+        return false;
+    }
+    imageSync(offset, clusterSize);
+    clusterCacheInsert(clusterNum, buffer);
+    return true;
+}
+
+//pointer to a cluster inside the cache, read straight into its slot on a miss
+//only valid until the next cache insert, returns NULL on error or when the cache is off
+const unsigned char* loadCachedCluster(int fd, unsigned int clusterNum, BootSectorInfo* bsi) {
+    if (clusterCache.capacity == 0 || clusterNum < 2) {
+        return NULL;
+    }
+    activeStats->clusterReads++;
+    unsigned char* cached = clusterCacheLookup(clusterNum);
+    if (cached) {
+        activeStats->clusterCacheHits++;
+        return cached;
+    }
+    cached = clusterCacheClaim(clusterNum);
+    if (!imageRead(fd, cached, clusterCache.clusterSize, clusterOffset(clusterNum, bsi))) {
+        clusterCacheDrop(clusterNum);
+        return NULL;
+    }
+    return cached;
+}
+
+//cluster number containing a byte offset of the data region
+unsigned int offsetCluster(off_t offset, BootSectorInfo* bsi) {
+    return (unsigned int)((offset / bsi->bytesPerSector - bsi->firstDataSector) / bsi->sectorsPerCluster) + 2;
+}
+
+//in-memory copy of the first FAT, loaded in chunks on demand
+//dirty sectors are written back to every FAT copy on flush
+typedef struct {
+    uint32_t* entries;
+    unsigned int numEntries;
+    unsigned int numSectors;
+    unsigned int numChunks;
+    bool* chunkLoaded;
+    bool* sectorDirty;
+    unsigned int dirtyCount;
+} FatCache;
+
+FatCache fatCache = {NULL, 0, 0, 0, NULL, NULL, 0};
+
+bool fatCacheInit(BootSectorInfo* bsi) {
+    fatCache.numSectors = bsi->sectorsPerFAT;
+    fatCache.numEntries = (bsi->sectorsPerFAT * bsi->bytesPerSector) / 4;
+    fatCache.numChunks = (fatCache.numSectors + FAT_CHUNK_SECTORS - 1) / FAT_CHUNK_SECTORS;
+    fatCache.entries = malloc((size_t)fatCache.numSectors * bsi->bytesPerSector);
+    fatCache.chunkLoaded = calloc(fatCache.numChunks, sizeof(bool));
+    fatCache.sectorDirty = calloc(fatCache.numSectors, sizeof(bool));
+    fatCache.dirtyCount = 0;
+    if (!fatCache.entries || !fatCache.chunkLoaded || !fatCache.sectorDirty) {
+        reply("Failed to allocate memory for FAT cache\n");
+        return false;
+    }
+    return true;
+}
+
+void fatCacheFree() {
+    free(fatCache.entries);
+    free(fatCache.chunkLoaded);
+    free(fatCache.sectorDirty);
+    fatCache.entries = NULL;
+    fatCache.chunkLoaded = NULL;
+    fatCache.sectorDirty = NULL;
+}
+
+//bring the chunk holding a FAT sector into memory with one bulk read
+static bool fatLoadChunk(int fd, unsigned int chunk, BootSectorInfo* bsi) {
+    if (fatCache.chunkLoaded[chunk]) {
+        return true;
+    }
+    unsigned int firstSector = chunk * FAT_CHUNK_SECTORS;
+    unsigned int count = fatCache.numSectors - firstSector;
+    if (count > FAT_CHUNK_SECTORS) count = FAT_CHUNK_SECTORS;
+
+    size_t offset = (size_t)firstSector * bsi->bytesPerSector;
+    if (!imageRead(fd, (unsigned char*)fatCache.entries + offset, (size_t)count * bsi->bytesPerSector,
+                   (off_t)bsi->reservedSectors * bsi->bytesPerSector + offset)) {
+        fprintf(stderr, "Error loading FAT sectors %u-%u\n", firstSector, firstSector + count - 1);
+        return false;
+    }
+    fatCache.chunkLoaded[chunk] = true;
+    return true;
+}
+
+//read a FAT entry, returns 0xFFFFFFFF on error
+uint32_t fatGet(int fd, unsigned int cluster, BootSectorInfo* bsi) {
+    if (cluster >= fatCache.numEntries) {
+        fprintf(stderr, "Cluster out of FAT range: %u\n", cluster);
+        return 0xFFFFFFFF;
+    }
+    unsigned int sector = cluster / (bsi->bytesPerSector / 4);
+    if (!fatLoadChunk(fd, sector / FAT_CHUNK_SECTORS, bsi)) {
+        return 0xFFFFFFFF;
+    }
+    return fatCache.entries[cluster] & FAT_ENTRY_MASK;
+}
+
+//update a FAT entry in memory and mark its sector dirty, the top 4 reserved bits are preserved
+bool fatSet(int fd, unsigned int cluster, uint32_t value, BootSectorInfo* bsi) {
+    if (cluster < 2 || cluster >= fatCache.numEntries) {
+        fprintf(stderr, "Cluster out of FAT range: %u\n", cluster);
+        return false;
+    }
+    unsigned int sector = cluster / (bsi->bytesPerSector / 4);
+    if (!fatLoadChunk(fd, sector / FAT_CHUNK_SECTORS, bsi)) {
+        return false;
+    }
+    fatCache.entries[cluster] = (fatCache.entries[cluster] & ~FAT_ENTRY_MASK) | (value & FAT_ENTRY_MASK);
+    if (!fatCache.sectorDirty[sector]) {
+        fatCache.sectorDirty[sector] = true;
+        fatCache.dirtyCount++;
+    }
+    return true;
+}
+
+//write dirty FAT sectors back, coalescing adjacent sectors into one write per FAT copy
+bool fatFlush(int fd, BootSectorInfo* bsi) {
+    if (fatCache.dirtyCount == 0) {
+        return true;
+    }
+    bool ok = true;
+    unsigned int sector = 0;
+    while (sector < fatCache.numSectors) {
+        if (!fatCache.sectorDirty[sector]) {
+            sector++;
+            continue;
+        }
+        unsigned int runEnd = sector;
+        while (runEnd < fatCache.numSectors && fatCache.sectorDirty[runEnd]) {
+            runEnd++;
+        }
+
+        size_t offset = (size_t)sector * bsi->bytesPerSector;
+        size_t len = (size_t)(runEnd - sector) * bsi->bytesPerSector;
+        bool written = true;
+        for (unsigned int copy = 0; copy < bsi->numFATs; copy++) {
+            off_t fatStart = ((off_t)bsi->reservedSectors + (off_t)copy * bsi->sectorsPerFAT) * bsi->bytesPerSector;
+            if (!imageWrite(fd, (unsigned char*)fatCache.entries + offset, len, fatStart + offset)) {
+                written = false;
+            } else {
+                imageSync(fatStart + offset, len);
+            }
+        }
+
+        //a run stays dirty until every FAT copy has it, so the next flush retries it
+        if (written) {
+            for (unsigned int s = sector; s < runEnd; s++) {
+                fatCache.sectorDirty[s] = false;
+            }
+            fatCache.dirtyCount -= runEnd - sector;
+        }
+        ok = ok && written;
+        sector = runEnd;
+    }
+    if (!ok) {
+        reply("Error writing FAT back to image\n");
+    }
+    return ok;
+}
+
+//free-space bitmap built from the FAT at mount, one bit per cluster (1 = in use)
+//free count and next-free hint are mirrored to the FSInfo sector on flush
+typedef struct {
+    uint64_t* bitmap;
+    unsigned int words;
+    unsigned int freeCount;
+    unsigned int nextFree;      //where the next search starts
+    bool fsInfoValid;
+    bool fsInfoDirty;
+} ClusterAllocator;
+
+ClusterAllocator allocator = {NULL, 0, 0, 2, false, false};
+
+static bool clusterUsed(unsigned int cluster) {
+    return (allocator.bitmap[cluster / 64] >> (cluster % 64)) & 1;
+}
+
+static void markCluster(unsigned int cluster, bool used) {
+    uint64_t bit = (uint64_t)1 << (cluster % 64);
+    if (used) allocator.bitmap[cluster / 64] |= bit;
+    else allocator.bitmap[cluster / 64] &= ~bit;
+}
+
+//load the whole FAT and build the bitmap 64 entries at a time
+bool allocatorInit(int fd, BootSectorInfo* bsi) {
+    for (unsigned int chunk = 0; chunk < fatCache.numChunks; chunk++) {
+        if (!fatLoadChunk(fd, chunk, bsi)) {
+            return false;
+        }
+    }
+
+    allocator.words = (bsi->maxCluster + 63) / 64;
+    allocator.bitmap = malloc(allocator.words * sizeof(uint64_t));
+    if (!allocator.bitmap) {
+        reply("Failed to allocate memory for free-cluster bitmap\n");
+        return false;
+    }
+
+    //branch-free inner loop so the compiler can vectorize the FAT scan
+    unsigned int freeCount = 0;
+    for (unsigned int word = 0; word < allocator.words; word++) {
+        unsigned int base = word * 64;
+        unsigned int n = bsi->maxCluster - base < 64 ? bsi->maxCluster - base : 64;
+        uint64_t bits = 0;
+        for (unsigned int b = 0; b < n; b++) {
+            bits |= (uint64_t)((fatCache.entries[base + b] & FAT_ENTRY_MASK) != 0) << b;
+        }
+        if (n < 64) {
+            bits |= ~(uint64_t)0 << n;
+        }
+        allocator.bitmap[word] = bits;
+        freeCount += __builtin_popcountll(~bits);
+    }
+
+    //clusters 0 and 1 are reserved
+    for (unsigned int c = 0; c < 2; c++) {
+        if (!clusterUsed(c)) {
+            markCluster(c, true);
+            freeCount--;
+        }
+    }
+    allocator.freeCount = freeCount;
+
+    //take the next-free hint from FSInfo when the sector is valid
+    uint32_t fsInfo[128];
+    allocator.fsInfoValid = false;
+    allocator.nextFree = 2;
+    if (bsi->fsInfoSector != 0 && bsi->fsInfoSector != 0xFFFF && bsi->bytesPerSector >= 512 &&
+        imageRead(fd, fsInfo, sizeof(fsInfo), (off_t)bsi->fsInfoSector * bsi->bytesPerSector) &&
+        fsInfo[0] == 0x41615252 && fsInfo[121] == 0x61417272) {
+        allocator.fsInfoValid = true;
+        if (fsInfo[123] >= 2 && fsInfo[123] < bsi->maxCluster) {
+            allocator.nextFree = fsInfo[123];
+        }
+        //keep FSInfo honest if its free count drifted
+        allocator.fsInfoDirty = fsInfo[122] != allocator.freeCount;
+    }
+    return true;
+}
+
+void allocatorFree() {
+    free(allocator.bitmap);
+    allocator.bitmap = NULL;
+}
+
+//find count free clusters in a row starting the search at from, 0 if there is no such run
+static unsigned int findFreeRun(unsigned int from, unsigned int count, BootSectorInfo* bsi) {
+    unsigned int runStart = 0, runLength = 0;
+    unsigned int cluster = from;
+    while (cluster < bsi->maxCluster) {
+        //skip fully used words in one step
+        if (cluster % 64 == 0 && allocator.bitmap[cluster / 64] == ~(uint64_t)0) {
+            runLength = 0;
+            cluster += 64;
+            continue;
+        }
+        if (clusterUsed(cluster)) {
+            runLength = 0;
+        } else {
+            if (runLength == 0) runStart = cluster;
+            if (++runLength == count) return runStart;
+        }
+        cluster++;
+    }
+    return 0;
+}
+
+//find the first free cluster at or after from, 0 if none
+static unsigned int findFreeCluster(unsigned int from, BootSectorInfo* bsi) {
+    for (unsigned int word = from / 64; word < allocator.words; word++) {
+        uint64_t freeBits = ~allocator.bitmap[word];
+        if (word == from / 64) {
+            freeBits &= ~(uint64_t)0 << (from % 64);
+        }
+        if (freeBits) {
+            unsigned int cluster = word * 64 + __builtin_ctzll(freeBits);
+            return cluster < bsi->maxCluster ? cluster : 0;
+        }
+    }
+    return 0;
+}
+
+//allocate count clusters as one chain, contiguous when a big enough free run exists
+//the chain is appended to prevCluster when that is a valid cluster
+//returns the first new cluster, or 0 if the image is full
+unsigned int allocateClusters(int fd, unsigned int count, unsigned int prevCluster, BootSectorInfo* bsi) {
+    if (count == 0 || count > allocator.freeCount) {
+        return 0;
+    }
+
+    //a run right after the previous cluster keeps the file in one extent
+    unsigned int start = 0;
+    if (prevCluster >= 2 && prevCluster + 1 < bsi->maxCluster) {
+        start = findFreeRun(prevCluster + 1, count, bsi);
+        if (start != prevCluster + 1) start = 0;
+    }
+    if (!start) start = findFreeRun(allocator.nextFree, count, bsi);
+    if (!start) start = findFreeRun(2, count, bsi);
+
+    unsigned int first = 0, last = prevCluster >= 2 ? prevCluster : 0;
+    unsigned int cursor = allocator.nextFree;
+    for (unsigned int i = 0; i < count; i++) {
+        unsigned int cluster;
+        if (start) {
+            cluster = start + i;
+        } else {
+            //no contiguous run, fall back to first fit from the hint
+            cluster = findFreeCluster(cursor, bsi);
+            if (!cluster) cluster = findFreeCluster(2, bsi);
+            cursor = cluster + 1;
+        }
+
+        markCluster(cluster, true);
+        allocator.freeCount--;
+        if (!fatSet(fd, cluster, FAT_ENTRY_MASK, bsi) || (last && !fatSet(fd, last, cluster, bsi))) {
+            return 0;
+        }
+        if (!first) first = cluster;
+        last = cluster;
+    }
+
+    allocator.nextFree = last + 1 < bsi->maxCluster ? last + 1 : 2;
+    allocator.fsInfoDirty = true;
+    return first;
+}
+
+//return a cluster to the free pool and clear its FAT entry
+bool releaseCluster(int fd, unsigned int cluster, BootSectorInfo* bsi) {
+    if (cluster < 2 || cluster >= bsi->maxCluster || !clusterUsed(cluster)) {
+        return false;
+    }
+    markCluster(cluster, false);
+    allocator.freeCount++;
+    if (cluster < allocator.nextFree) {
+        allocator.nextFree = cluster;
+    }
+    allocator.fsInfoDirty = true;
+    return fatSet(fd, cluster, 0, bsi);
+}
+
+//free a whole cluster chain, returns how many clusters were released
+//stops early at a cluster that is already free, which also ends a looping chain
+unsigned int releaseChain(int fd, unsigned int head, BootSectorInfo* bsi) {
+    unsigned int freed = 0;
+    unsigned int cluster = head;
+    while (cluster >= 2 && cluster < bsi->maxCluster) {
+        unsigned int next = getNextCluster(fd, cluster, bsi);
+        if (!releaseCluster(fd, cluster, bsi)) {
+            break;
+        }
+        freed++;
+        cluster = next;
+    }
+    return freed;
+}
+
+//write the free count and next-free hint back to FSInfo
+bool allocatorFlush(int fd, BootSectorInfo* bsi) {
+    if (!allocator.fsInfoValid || !allocator.fsInfoDirty) {
+        return true;
+    }
+    uint32_t hint[2] = {allocator.freeCount, allocator.nextFree};
+    off_t offset = (off_t)bsi->fsInfoSector * bsi->bytesPerSector + 488;
+    if (!imageWrite(fd, hint, sizeof(hint), offset)) {
+        reply("Error updating FSInfo sector\n");
+        return false;
+    }
+    imageSync(offset, sizeof(hint));
+    allocator.fsInfoDirty = false;
+    return true;
+}
+
+//directory entry cache: (parent cluster, packed name) -> child cluster, direct mapped
+//lets path resolution skip loading every directory along a path
+typedef struct {
+    unsigned int parent;
+    char name[11];
+    uint8_t attr;
+    unsigned int child;
+    bool valid;
+} Dentry;
+
+__thread Dentry dentryCache[DENTRY_SLOTS];
+
+static unsigned int dentrySlot(unsigned int parent, const char* packed) {
+    uint32_t h = 2166136261u ^ parent;
+    for (int i = 0; i < 11; i++) {
+        h ^= (unsigned char)packed[i];
+        h *= 16777619u;
+    }
+    return h % DENTRY_SLOTS;
+}
+
+static Dentry* dentryLookup(unsigned int parent, const char* packed) {
+    Dentry* d = &dentryCache[dentrySlot(parent, packed)];
+    if (d->valid && d->parent == parent && memcmp(d->name, packed, 11) == 0) {
+        return d;
+    }
+    return NULL;
+}
+
+static void dentryStore(unsigned int parent, const char* packed, unsigned int child, uint8_t attr) {
+    Dentry* d = &dentryCache[dentrySlot(parent, packed)];
+    d->parent = parent;
+    memcpy(d->name, packed, 11);
+    d->child = child;
+    d->attr = attr;
+    d->valid = true;
+}
+
+//forget one name, called whenever a live entry is changed or deleted
+void dentryForget(unsigned int parent, const char* packed) {
+    Dentry* d = dentryLookup(parent, packed);
+    if (d) {
+        d->valid = false;
+    }
+}
+
+//forget every name under a directory that is going away
+void dentryForgetParent(unsigned int parent) {
+    for (int i = 0; i < DENTRY_SLOTS; i++) {
+        if (dentryCache[i].valid && dentryCache[i].parent == parent) {
+            dentryCache[i].valid = false;
+        }
+    }
+}
+
+//directory scan kernels: find entries whose first name byte is a marker (0x00 end, 0xE5 deleted)
+//several entries are tested per instruction, the widest version the CPU supports is picked at startup
+static unsigned int findMarkerScalar(const DirEntry* entries, unsigned int from, unsigned int count, unsigned char marker) {
+    for (unsigned int i = from; i < count; i++) {
+        if ((unsigned char)entries[i].name[0] == marker) {
+            return i;
+        }
+    }
+    return count;
+}
+
+static unsigned int countMarkerScalar(const DirEntry* entries, unsigned int count, unsigned char marker) {
+    unsigned int n = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        n += (unsigned char)entries[i].name[0] == marker;
+    }
+    return n;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+//bit 4*k of the result is set when entry from+k starts with the marker (SSE2, 4 entries)
+static inline int markerMask4(const DirEntry* entries, __m128i marker) {
+    __m128i a = _mm_loadu_si128((const __m128i*)&entries[0]);
+    __m128i b = _mm_loadu_si128((const __m128i*)&entries[1]);
+    __m128i c = _mm_loadu_si128((const __m128i*)&entries[2]);
+    __m128i d = _mm_loadu_si128((const __m128i*)&entries[3]);
+    //gather the first dword of each entry into one register
+    __m128i firsts = _mm_unpacklo_epi64(_mm_unpacklo_epi32(a, b), _mm_unpacklo_epi32(c, d));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(firsts, marker)) & 0x1111;
+}
+
+static unsigned int findMarkerSSE2(const DirEntry* entries, unsigned int from, unsigned int count, unsigned char marker) {
+    __m128i m = _mm_set1_epi8((char)marker);
+    unsigned int i = from;
+    for (; i + 4 <= count; i += 4) {
+        int mask = markerMask4(entries + i, m);
+        if (mask) {
+            return i + __builtin_ctz(mask) / 4;
+        }
+    }
+    return findMarkerScalar(entries, i, count, marker);
+}
+
+static unsigned int countMarkerSSE2(const DirEntry* entries, unsigned int count, unsigned char marker) {
+    __m128i m = _mm_set1_epi8((char)marker);
+    unsigned int n = 0, i = 0;
+    for (; i + 4 <= count; i += 4) {
+        n += __builtin_popcount(markerMask4(entries + i, m));
+    }
+    return n + countMarkerScalar(entries + i, count - i, marker);
+}
+
+//AVX2: one gather pulls the first dword of 8 entries
+__attribute__((target("avx2")))
+static inline unsigned int markerMask8(const DirEntry* entries, __m256i marker) {
+    const __m256i stride = _mm256_setr_epi32(0, 8, 16, 24, 32, 40, 48, 56);
+    __m256i firsts = _mm256_i32gather_epi32((const int*)entries, stride, 4);
+    return (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(firsts, marker)) & 0x11111111u;
+}
+
+__attribute__((target("avx2")))
+static unsigned int findMarkerAVX2(const DirEntry* entries, unsigned int from, unsigned int count, unsigned char marker) {
+    __m256i m = _mm256_set1_epi8((char)marker);
+    unsigned int i = from;
+    for (; i + 8 <= count; i += 8) {
+        unsigned int mask = markerMask8(entries + i, m);
+        if (mask) {
+            return i + __builtin_ctz(mask) / 4;
+        }
+    }
+    return findMarkerScalar(entries, i, count, marker);
+}
+
+__attribute__((target("avx2")))
+static unsigned int countMarkerAVX2(const DirEntry* entries, unsigned int count, unsigned char marker) {
+    __m256i m = _mm256_set1_epi8((char)marker);
+    unsigned int n = 0, i = 0;
+    for (; i + 8 <= count; i += 8) {
+        n += __builtin_popcount(markerMask8(entries + i, m));
+    }
+    return n + countMarkerScalar(entries + i, count - i, marker);
+}
+#endif
+
+unsigned int (*findMarker)(const DirEntry*, unsigned int, unsigned int, unsigned char) = findMarkerScalar;
+unsigned int (*countMarker)(const DirEntry*, unsigned int, unsigned char) = countMarkerScalar;
+const char* scanKernel = "scalar";
+
+//pick the scan kernels once, FAT_SIMD=scalar|sse2|avx2 overrides the choice
+void selectScanKernels() {
+#if defined(__x86_64__) || defined(__i386__)
+    const char* forced = getenv("FAT_SIMD");
+    __builtin_cpu_init();
+    if ((!forced || strcmp(forced, "avx2") == 0) && __builtin_cpu_supports("avx2")) {
+        findMarker = findMarkerAVX2;
+        countMarker = countMarkerAVX2;
+        scanKernel = "avx2";
+    } else if ((!forced || strcmp(forced, "scalar") != 0) && __builtin_cpu_supports("sse2")) {
+        findMarker = findMarkerSSE2;
+        countMarker = countMarkerSSE2;
+        scanKernel = "sse2";
+    }
+#endif
+}
+
+//compare an entry's name against a packed name padded to 16 bytes, one vector compare on x86
+static inline bool entryNameEquals(const DirEntry* entry, const char padded[16]) {
+#if defined(__x86_64__) || defined(__i386__)
+    __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)entry), _mm_loadu_si128((const __m128i*)padded));
+    return (_mm_movemask_epi8(eq) & 0x7FF) == 0x7FF;
+#else
+    return memcmp(entry->name, padded, 11) == 0;
+#endif
+}
+
+//cached copy of one directory: every entry across its whole cluster chain,
+//plus a hash index over the packed 8.3 names of the live entries
+typedef struct {
+    unsigned int cluster;       //first cluster of the directory, the cache key
+    unsigned int* clusters;     //the directory's cluster chain
+    unsigned int clusterCount;
+    DirEntry* entries;          //clusterCount clusters worth of entries, in chain order
+    unsigned int capacity;
+    unsigned int endIndex;      //index of the 0x00 end marker, capacity if there is none
+    unsigned int freeCount;     //deleted (0xE5) slots below endIndex
+    int* buckets;
+    int* chain;
+    unsigned int bucketMask;
+    bool* sectorDirty;          //sectors of the chain changed in memory but not written yet
+    unsigned int dirtyCount;
+    unsigned long lastUsed;
+    bool valid;
+} DirCache;
+
+__thread DirCache dirCache[DIR_CACHE_SLOTS];
+__thread unsigned long dirCacheTick = 0;
+
+//convert a typed name like "file.txt" to the space padded on-disk form "FILE    TXT"
+bool packName(const char* name, char packed[11]) {
+    memset(packed, ' ', 11);
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        memcpy(packed, name, strlen(name));
+        return true;
+    }
+
+    const char* dot = strrchr(name, '.');
+    size_t baseLen = dot ? (size_t)(dot - name) : strlen(name);
+    size_t extLen = dot ? strlen(dot + 1) : 0;
+    if (baseLen == 0 || baseLen > 8 || extLen > 3) {
+        return false;
+    }
+
+    for (size_t i = 0; i < baseLen + extLen; i++) {
+        unsigned char c = (i < baseLen) ? name[i] : dot[1 + i - baseLen];
+        if (c < 0x20 || strchr("\"*+,./:;<=>?[\\]|", c)) {
+            return false;
+        }
+        packed[(i < baseLen) ? i : 8 + i - baseLen] = toupper(c);
+    }
+    return true;
+}
+
+static unsigned int hashName(const char* packed) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < 11; i++) {
+        h ^= (unsigned char)packed[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static bool isLiveEntry(DirCache* dc, unsigned int index) {
+    unsigned char first = (unsigned char)dc->entries[index].name[0];
+    return index < dc->endIndex && first != 0x00 && first != 0xE5;
+}
+
+static void indexInsert(DirCache* dc, unsigned int index) {
+    unsigned int bucket = hashName(dc->entries[index].name) & dc->bucketMask;
+    dc->chain[index] = dc->buckets[bucket];
+    dc->buckets[bucket] = index;
+}
+
+static void indexRemove(DirCache* dc, unsigned int index) {
+    int* link = &dc->buckets[hashName(dc->entries[index].name) & dc->bucketMask];
+    while (*link != -1) {
+        if (*link == (int)index) {
+            *link = dc->chain[index];
+            return;
+        }
+        link = &dc->chain[*link];
+    }
+}
+
+static void freeDirSlot(DirCache* dc) {
+    free(dc->clusters);
+    free(dc->entries);
+    free(dc->buckets);
+    free(dc->chain);
+    free(dc->sectorDirty);
+    memset(dc, 0, sizeof(DirCache));
+}
+
+//group commit (-G N): directory sectors, FAT sectors and FSInfo changed by commands stay in memory
+//and are written together with a single fsync every N commands that leave metadata dirty,
+//on 'sync' and at exit; with interval 0 every change is written right away, without an fsync
+typedef struct {
+    unsigned int interval;
+    unsigned int pending;       //commands since the last commit that left metadata dirty
+} GroupCommit;
+
+GroupCommit groupCommit = {0, 0};
+
+//mark the sector holding an entry as changed
+static void markEntryDirty(DirCache* dc, unsigned int index, BootSectorInfo* bsi) {
+    unsigned int sector = (unsigned int)(((size_t)index * sizeof(DirEntry)) / bsi->bytesPerSector);
+    if (!dc->sectorDirty[sector]) {
+        dc->sectorDirty[sector] = true;
+        dc->dirtyCount++;
+    }
+}
+
+//write a directory's dirty sectors back, one write per physically contiguous run of them
+bool dirFlush(int fd, DirCache* dc, BootSectorInfo* bsi) {
+    if (dc->dirtyCount == 0) {
+        return true;
+    }
+    unsigned int sectors = dc->clusterCount * bsi->sectorsPerCluster;
+    const unsigned char* data = (const unsigned char*)dc->entries;
+    bool ok = true;
+    unsigned int sector = 0;
+    while (sector < sectors) {
+        if (!dc->sectorDirty[sector]) {
+            sector++;
+            continue;
+        }
+        //a run may cross into the next cluster of the chain only if that cluster follows on disk
+        unsigned int runEnd = sector + 1;
+        while (runEnd < sectors && dc->sectorDirty[runEnd] &&
+               (runEnd % bsi->sectorsPerCluster != 0 ||
+                dc->clusters[runEnd / bsi->sectorsPerCluster] == dc->clusters[runEnd / bsi->sectorsPerCluster - 1] + 1)) {
+            runEnd++;
+        }
+
+        unsigned int cluster = dc->clusters[sector / bsi->sectorsPerCluster];
+        off_t offset = clusterOffset(cluster, bsi) + (off_t)(sector % bsi->sectorsPerCluster) * bsi->bytesPerSector;
+        size_t len = (size_t)(runEnd - sector) * bsi->bytesPerSector;
+        const unsigned char* src = data + (size_t)sector * bsi->bytesPerSector;
+        if (imageWrite(fd, src, len, offset)) {
+            imageSync(offset, len);
+            for (unsigned int i = sector; i < runEnd; i++) {
+                clusterCachePatch(dc->clusters[i / bsi->sectorsPerCluster], (i % bsi->sectorsPerCluster) * bsi->bytesPerSector,
+                                  data + (size_t)i * bsi->bytesPerSector, bsi->bytesPerSector);
+                dc->sectorDirty[i] = false;
+            }
+            dc->dirtyCount -= runEnd - sector;
+        } else {
+            //an unwritten run stays dirty so the next flush retries it, and the cluster cache keeps what is on disk
+            ok = false;
+        }
+        sector = runEnd;
+    }
+    return ok;
+}
+
+//drop a directory from the cache, e.g. after it has been removed
+void invalidateDirectory(unsigned int cluster) {
+    dentryForgetParent(cluster);
+    for (int i = 0; i < DIR_CACHE_SLOTS; i++) {
+        if (dirCache[i].valid && dirCache[i].cluster == cluster) {
+            freeDirSlot(&dirCache[i]);
+        }
+    }
+}
+
+void dirCacheFree() {
+    for (int i = 0; i < DIR_CACHE_SLOTS; i++) {
+        freeDirSlot(&dirCache[i]);
+    }
+}
+
+//return the cached directory starting at cluster, reading its whole chain on a miss
+DirCache* loadDirectory(int fd, unsigned int cluster, BootSectorInfo* bsi) {
+    dirCacheTick++;
+    DirCache* victim = &dirCache[0];
+    for (int i = 0; i < DIR_CACHE_SLOTS; i++) {
+        if (dirCache[i].valid && dirCache[i].cluster == cluster) {
+            dirCache[i].lastUsed = dirCacheTick;
+            return &dirCache[i];
+        }
+        if (!dirCache[i].valid) {
+            if (victim->valid) victim = &dirCache[i];
+        } else if (victim->valid && dirCache[i].lastUsed < victim->lastUsed) {
+            victim = &dirCache[i];
+        }
+    }
+    //changes held back by group commit go out before the slot is reused
+    if (victim->valid && !dirFlush(fd, victim, bsi)) {
+        reply("Error writing directory back to image\n");
+    }
+    freeDirSlot(victim);
+    DirCache* dc = victim;
+
+    //collect the cluster chain
+    unsigned int chainCapacity = 0;
+    unsigned int current = cluster;
+    while (current >= 2 && current != 0xFFFFFFFF) {
+        if (dc->clusterCount >= bsi->totalClusters) {
+            reply("Error: Directory cluster chain loops\n");
+            freeDirSlot(dc);
+            return NULL;
+        }
+        if (dc->clusterCount == chainCapacity) {
+            chainCapacity = chainCapacity ? chainCapacity * 2 : 4;
+            unsigned int* grown = realloc(dc->clusters, chainCapacity * sizeof(unsigned int));
+            if (!grown) {
+                reply("Failed to allocate memory for directory cache\n");
+                freeDirSlot(dc);
+                return NULL;
+            }
+            dc->clusters = grown;
+        }
+        dc->clusters[dc->clusterCount++] = current;
+        current = getNextCluster(fd, current, bsi);
+    }
+    if (dc->clusterCount == 0) {
+        reply("Error: Invalid directory cluster %u\n", cluster);
+        freeDirSlot(dc);
+        return NULL;
+    }
+
+    unsigned int clusterSize = bsi->bytesPerSector * bsi->sectorsPerCluster;
+    unsigned int perCluster = clusterSize / sizeof(DirEntry);
+    dc->capacity = dc->clusterCount * perCluster;
+    dc->entries = malloc((size_t)dc->clusterCount * clusterSize);
+
+    unsigned int buckets = 16;
+    while (buckets < dc->capacity) buckets <<= 1;
+    dc->bucketMask = buckets - 1;
+    dc->buckets = malloc(buckets * sizeof(int));
+    dc->chain = malloc(dc->capacity * sizeof(int));
+    dc->sectorDirty = calloc((size_t)dc->clusterCount * bsi->sectorsPerCluster, sizeof(bool));
+    if (!dc->entries || !dc->buckets || !dc->chain || !dc->sectorDirty) {
+        reply("Failed to allocate memory for directory cache\n");
+        freeDirSlot(dc);
+        return NULL;
+    }
+
+    for (unsigned int i = 0; i < dc->clusterCount; i++) {
+        if (!readCluster(fd, dc->clusters[i], (unsigned char*)(dc->entries + (size_t)i * perCluster), bsi)) {
+            freeDirSlot(dc);
+            return NULL;
+        }
+    }
+
+    //find the end marker and deleted slots in bulk, then index every live entry
+    memset(dc->buckets, 0xFF, buckets * sizeof(int));
+    dc->endIndex = findMarker(dc->entries, 0, dc->capacity, 0x00);
+    dc->freeCount = countMarker(dc->entries, dc->endIndex, 0xE5);
+    for (unsigned int i = 0; i < dc->endIndex; i++) {
+        if ((unsigned char)dc->entries[i].name[0] != 0xE5) {
+            indexInsert(dc, i);
+        }
+    }
+
+    dc->cluster = cluster;
+    dc->lastUsed = dirCacheTick;
+    dc->valid = true;
+    return dc;
+}
+
+//index of the live entry with this packed name, or -1
+int findEntry(DirCache* dc, const char packed[11]) {
+    char padded[16] = {0};
+    memcpy(padded, packed, 11);
+    int index = dc->buckets[hashName(packed) & dc->bucketMask];
+    while (index != -1) {
+        if (entryNameEquals(&dc->entries[index], padded)) {
+            return index;
+        }
+        index = dc->chain[index];
+    }
+    return -1;
+}
+
+//index of a slot a new entry can go into, or -1 if the directory is full
+int findFreeEntry(DirCache* dc) {
+    if (dc->freeCount > 0) {
+        unsigned int i = findMarker(dc->entries, 0, dc->endIndex, 0xE5);
+        if (i < dc->endIndex) {
+            return i;
+        }
+    }
+    return dc->endIndex < dc->capacity ? (int)dc->endIndex : -1;
+}
+
+//replace one entry, keep the index in step and write the sector holding it back
+//(with group commit the sector is only marked dirty)
+bool updateEntry(int fd, DirCache* dc, unsigned int index, const DirEntry* newEntry, BootSectorInfo* bsi) {
+    if (isLiveEntry(dc, index)) {
+        indexRemove(dc, index);
+        dentryForget(dc->cluster, dc->entries[index].name);
+    } else if (index < dc->endIndex) {
+        dc->freeCount--;
+    }
+
+    dc->entries[index] = *newEntry;
+    if (index >= dc->endIndex) {
+        dc->endIndex = index + 1;
+    }
+    if ((unsigned char)newEntry->name[0] == 0xE5) {
+        dc->freeCount++;
+    } else {
+        indexInsert(dc, index);
+    }
+
+    markEntryDirty(dc, index, bsi);
+    if (groupCommit.interval == 0 && !dirFlush(fd, dc, bsi)) {
+        //the image and the cache disagree now, reread next time
+        invalidateDirectory(dc->cluster);
+        return false;
+    }
+    return true;
+}
+
+//append clusters to a directory's chain, zero them and return the reloaded cache slot
+//returns NULL if the image is full
+DirCache* growDirectory(int fd, DirCache* dc, unsigned int extraClusters, BootSectorInfo* bsi) {
+    unsigned int cluster = dc->cluster;
+    unsigned int clusterSize = bsi->bytesPerSector * bsi->sectorsPerCluster;
+    unsigned char* zeros = arenaAlloc(clusterSize);
+    unsigned int first = zeros ? allocateClusters(fd, extraClusters, dc->clusters[dc->clusterCount - 1], bsi) : 0;
+    if (!first) {
+        reply("Error: No free clusters to grow the directory\n");
+        return NULL;
+    }
+    memset(zeros, 0, clusterSize);
+    for (unsigned int c = first, i = 0; i < extraClusters; i++, c = fatGet(fd, c, bsi)) {
+        if (!writeCluster(fd, c, zeros, bsi)) {
+            return NULL;
+        }
+    }
+    //the reload reads the image, so pending entries have to be there first
+    if (!dirFlush(fd, dc, bsi)) {
+        return NULL;
+    }
+    invalidateDirectory(cluster);
+    return loadDirectory(fd, cluster, bsi);
+}
+
+//slots still available without growing the chain
+unsigned int freeEntrySlots(DirCache* dc) {
+    return dc->freeCount + (dc->capacity - dc->endIndex);
+}
+
+//insert many entries at once, each touched sector is written back a single time
+//the caller makes sure freeEntrySlots covers count
+bool addEntries(int fd, DirCache* dc, const DirEntry* newEntries, unsigned int count, BootSectorInfo* bsi) {
+    if (count > freeEntrySlots(dc)) {
+        reply("Error: No space in directory for %u new entries\n", count);
+        return false;
+    }
+
+    unsigned int scan = 0;
+    for (unsigned int n = 0; n < count; n++) {
+        //reuse deleted slots first, then extend past the end marker
+        if (dc->freeCount > 0) {
+            scan = findMarker(dc->entries, scan, dc->endIndex, 0xE5);
+        }
+        unsigned int index;
+        if (dc->freeCount > 0 && scan < dc->endIndex) {
+            index = scan;
+            dc->freeCount--;
+        } else {
+            index = dc->endIndex++;
+        }
+        dc->entries[index] = newEntries[n];
+        indexInsert(dc, index);
+        markEntryDirty(dc, index, bsi);
+    }
+
+    if (groupCommit.interval == 0 && !dirFlush(fd, dc, bsi)) {
+        invalidateDirectory(dc->cluster);
+        return false;
+    }
+    return true;
+}
+
+//true while group commit is holding back any directory, FAT or FSInfo change
+bool metadataDirty() {
+    if (fatCache.dirtyCount > 0 || allocator.fsInfoDirty) {
+        return true;
+    }
+    for (int i = 0; i < DIR_CACHE_SLOTS; i++) {
+        if (dirCache[i].valid && dirCache[i].dirtyCount > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+//write every held back metadata change: the FAT copies first so no entry reaches the image
+//before the chain it points to, then directory sectors, then FSInfo
+bool writeBackMetadata(int fd, BootSectorInfo* bsi) {
+    bool ok = fatFlush(fd, bsi);
+    for (int i = 0; i < DIR_CACHE_SLOTS; i++) {
+        if (dirCache[i].valid && !dirFlush(fd, &dirCache[i], bsi)) {
+            reply("Error writing directory back to image\n");
+            ok = false;
+        }
+    }
+    return allocatorFlush(fd, bsi) && ok;
+}
+
+//end of a group: write everything back in order and make it durable with one fsync
+bool commitMetadata(int fd, BootSectorInfo* bsi) {
+    bool ok = writeBackMetadata(fd, bsi);
+    activeStats->syscalls++;
+    if (overlay.fd >= 0) {
+        ok = overlaySync(&activeStats->syscalls) && ok;
+    } else if (image.map ? msync(image.map, image.size, MS_SYNC) < 0 : fdatasync(fd) < 0) {
+        perror("Error syncing image");
+        ok = false;
+    }
+    //a failed group stays pending, so the next command that changes metadata retries it
+    if (ok) {
+        groupCommit.pending = 0;
+    }
+    return ok;
+}
+
+//called where a command would write the FAT and FSInfo, deferred while group commit is on
+bool metadataFlush(int fd, BootSectorInfo* bsi) {
+    if (groupCommit.interval > 0) {
+        return true;
+    }
+    return fatFlush(fd, bsi) && allocatorFlush(fd, bsi);
+}
+
+//first cluster stored in a directory entry
+unsigned int entryCluster(const DirEntry* entry) {
+    return ((unsigned int)entry->firstClusterHigh << 16) | entry->firstClusterLow;
+}
+
+//8.3 name of an entry as it would be typed
+void formatEntryName(const DirEntry* entry, char out[13]) {
+    int len = 0;
+    for (int i = 0; i < 8 && entry->name[i] != ' '; i++) out[len++] = entry->name[i];
+    if (entry->name[8] != ' ') {
+        out[len++] = '.';
+        for (int i = 8; i < 11 && entry->name[i] != ' '; i++) out[len++] = entry->name[i];
+    }
+    out[len] = '\0';
+}
+
+//cluster of a child entry by name, 0xFFFFFFFF if there is none
+//attr receives the entry's attribute byte
+unsigned int lookupChild(int fd, unsigned int parent, const char* packed, uint8_t* attr, BootSectorInfo* bsi) {
+    Dentry* d = dentryLookup(parent, packed);
+    if (d) {
+        *attr = d->attr;
+        return d->child;
+    }
+
+    DirCache* dir = loadDirectory(fd, parent, bsi);
+    int index = dir ? findEntry(dir, packed) : -1;
+    if (index < 0) {
+        return 0xFFFFFFFF;
+    }
+    unsigned int child = entryCluster(&dir->entries[index]);
+    if (child == 0 && (dir->entries[index].attr & ATTR_DIRECTORY)) {
+        child = bsi->rootCluster;
+    }
+    *attr = dir->entries[index].attr;
+    dentryStore(parent, packed, child, *attr);
+    return child;
+}
+
+//walk an absolute or relative directory path starting from a context
+//'..' pops the parent stack, so it works at any depth; the result is only written on success
+bool resolveDirectory(int fd, const char* path, const DirectoryContext* from, DirectoryContext* out, BootSectorInfo* bsi) {
+    DirectoryContext ctx = *from;
+    if (path[0] == '/') {
+        ctx.currentCluster = bsi->rootCluster;
+        strcpy(ctx.path, "/");
+        ctx.depth = 0;
+    }
+
+    char component[256];
+    const char* cursor = path;
+    while (*cursor) {
+        size_t len = strcspn(cursor, "/");
+        if (len >= sizeof(component)) {
+            reply("Error: Path component too long\n");
+            return false;
+        }
+        memcpy(component, cursor, len);
+        component[len] = '\0';
+        cursor += len;
+        if (*cursor == '/') cursor++;
+
+        if (len == 0 || strcmp(component, ".") == 0) {
+            continue;
+        }
+        if (strcmp(component, "..") == 0) {
+            if (ctx.depth > 0) {
+                ctx.currentCluster = ctx.parents[--ctx.depth];
+                char* lastSlash = strrchr(ctx.path, '/');
+                if (lastSlash == ctx.path) lastSlash[1] = '\0';
+                else *lastSlash = '\0';
+            }
+            continue;
+        }
+
+        char packed[11];
+        uint8_t attr = 0;
+        unsigned int child = packName(component, packed) ? lookupChild(fd, ctx.currentCluster, packed, &attr, bsi) : 0xFFFFFFFF;
+        if (child == 0xFFFFFFFF || !(attr & ATTR_DIRECTORY)) {
+            reply("Directory not found: %s\n", path);
+            return false;
+        }
+        if (ctx.depth == MAX_DIR_DEPTH) {
+            reply("Error: Path too deep\n");
+            return false;
+        }
+
+        size_t pathLen = strlen(ctx.path);
+        if (pathLen + (pathLen > 1) + len >= sizeof(ctx.path)) {
+            reply("Error: New path too long\n");
+            return false;
+        }
+        if (pathLen > 1) ctx.path[pathLen++] = '/';
+        strcpy(ctx.path + pathLen, component);
+
+        ctx.parents[ctx.depth++] = ctx.currentCluster;
+        ctx.currentCluster = child;
+    }
+
+    *out = ctx;
+    return true;
+}
+
+//split "a/b/name" into the cluster of directory a/b and "name"
+//plain names resolve to the current directory, returns false if the directory part does not exist
+bool resolveParent(int fd, const char* path, DirectoryContext* context, unsigned int* dirCluster, char name[256], BootSectorInfo* bsi) {
+    const char* lastSlash = strrchr(path, '/');
+    if (!lastSlash) {
+        *dirCluster = context->currentCluster;
+        snprintf(name, 256, "%s", path);
+        return true;
+    }
+
+    char dirPath[512];
+    size_t dirLen = lastSlash == path ? 1 : (size_t)(lastSlash - path);
+    if (dirLen >= sizeof(dirPath)) {
+        reply("Error: Path too long\n");
+        return false;
+    }
+    memcpy(dirPath, path, dirLen);
+    dirPath[dirLen] = '\0';
+
+    DirectoryContext target;
+    if (!resolveDirectory(fd, dirPath, context, &target, bsi)) {
+        return false;
+    }
+    *dirCluster = target.currentCluster;
+    snprintf(name, 256, "%s", lastSlash + 1);
+    return true;
+}
+
+//fucntion to handle the cd command, accepts absolute and multi-component paths
+void changeDirectory(int fd, const char* dirName, DirectoryContext* context, BootSectorInfo* bsi) {
+    if (strcmp(dirName, ".") == 0) {
+        status("Staying in the current directory.\n");
+        return; 
+    }
+
+    if (strcmp(dirName, "..") == 0 && context->depth == 0) {
+        status("Already in the root directory.\n");
+        return; 
+    }
+
+    if (!resolveDirectory(fd, dirName, context, context, bsi)) {
+        return;
+    }
+
+    if (strcmp(dirName, "..") == 0) {
+        status("Changed directory to parent: %s\n", context->path);
+    } else {
+        status("Changed directory to %s\n", context->path);
+    }
+}
+
+//info function
+void printBootSectorInfo(const char *imagePath) {
+    //open the image with correct permissions
+    int fd = open(imagePath, O_RDONLY);
+    if (fd < 0) {
+        perror("Failed to open image file");
+        return;
+    }
+
+    //read the boot sector and print an error message if failed
+    unsigned char bootSector[512];
+    if (read(fd, bootSector, sizeof(bootSector)) != sizeof(bootSector)) {
+        perror("Failed to read boot sector");
+        close(fd);
+        return;
+    }
+
+    //print the size of the image file
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("Failed to get image file size");
+        close(fd);
+        return;
+    }
+
+    //populate all values for an instance of BootSectorInfo
+    BootSectorInfo info = {
+        .bytesPerSector = *(unsigned short *)(bootSector + 11),
+        .sectorsPerCluster = *(bootSector + 13),
+        .rootCluster = *(unsigned int *)(bootSector + 44),
+        .sectorsPerFAT = *(unsigned int *)(bootSector + 36),
+        .sizeOfImage = st.st_size
+    };
+    info.totalClusters = (st.st_size / (info.sectorsPerCluster * info.bytesPerSector));
+
+    //print all data values
+    reply("Bytes Per Sector: %u\n", info.bytesPerSector);
+    reply("Sectors Per Cluster: %u\n", info.sectorsPerCluster);
+    reply("Root Cluster: %u\n", info.rootCluster);
+    reply("Total # of Clusters in Data Region: %u\n", info.totalClusters);
+    reply("# of Entries in One FAT: %u\n", info.sectorsPerFAT);
+    reply("Size of Image (in bytes): %llu\n", info.sizeOfImage);
+
+    close(fd);
+}
+
+//fucntion to handle ls command
+void listDirectory(int fd, DirectoryContext* context, BootSectorInfo* bsi) {
+    //the cached directory covers every cluster of the chain
+    DirCache* dir = loadDirectory(fd, context->currentCluster, bsi);
+    if (!dir) {
+        return;
+    }
+
+    //print '.' and '..'
+    reply(".\n..\n"); 
+
+    //print all entries unless it was deleted
+    for (unsigned int i = 0; i < dir->endIndex; i++) {
+        DirEntry* entry = &dir->entries[i];
+        if ((unsigned char)entry->name[0] == 0xE5) continue;
+
+        reply("%.11s\n", entry->name); 
+    }
+}
+
+//function to handle mkdir 
+void createDirectory(int fd, const char* dirName, DirectoryContext* context, BootSectorInfo* bsi) {
+    char name[256];
+    unsigned int dirCluster;
+    if (!resolveParent(fd, dirName, context, &dirCluster, name, bsi)) {
+        return;
+    }
+    char packed[11];
+    if (!packName(name, packed) || packed[0] == '.') {
+        reply("Error: Invalid directory name: %s\n", dirName);
+        return;
+    }
+
+    DirCache* dir = loadDirectory(fd, dirCluster, bsi);
+    if (!dir) {
+        return;
+    }
+    if (findEntry(dir, packed) >= 0) {
+        reply("Error: A file or directory with this name already exists.\n");
+        return;
+    }
+
+    //search for a free entry
+    int index = findFreeEntry(dir);
+
+    //if the directory is full, print error. if it is created successfully, print a success message
+    if (index < 0) {
+        reply("No space in current directory to create new directory\n");
+        return;
+    }
+
+    //give the new directory its own cluster from the allocator
+    unsigned int newCluster = allocateClusters(fd, 1, 0, bsi);
+    if (newCluster == 0) {
+        reply("Error: No free clusters left on the image\n");
+        return;
+    }
+
+    //the new cluster holds only '.' and '..', '..' is 0 when the parent is the root
+    unsigned int clusterSize = bsi->bytesPerSector * bsi->sectorsPerCluster;
+    unsigned char* buffer = arenaAlloc(clusterSize);
+    if (!buffer) {
+        releaseCluster(fd, newCluster, bsi);
+        return;
+    }
+    memset(buffer, 0, clusterSize);
+    unsigned int parentCluster = dirCluster == bsi->rootCluster ? 0 : dirCluster;
+    DirEntry* dots = (DirEntry*)buffer;
+    memcpy(dots[0].name, ".          ", 11);
+    dots[0].attr = ATTR_DIRECTORY;
+    dots[0].firstClusterHigh = newCluster >> 16;
+    dots[0].firstClusterLow = newCluster & 0xFFFF;
+    memcpy(dots[1].name, "..         ", 11);
+    dots[1].attr = ATTR_DIRECTORY;
+    dots[1].firstClusterHigh = parentCluster >> 16;
+    dots[1].firstClusterLow = parentCluster & 0xFFFF;
+
+    if (!writeCluster(fd, newCluster, buffer, bsi)) {
+        releaseCluster(fd, newCluster, bsi);
+        metadataFlush(fd, bsi);
+        reply("Error writing new directory cluster\n");
+        return;
+    }
+
+    DirEntry entry;
+    memset(&entry, 0, sizeof(DirEntry)); 
+    memcpy(entry.name, packed, 11); 
+    entry.attr = ATTR_DIRECTORY;
+    entry.firstClusterLow = newCluster & 0xFFFF; 
+    entry.firstClusterHigh = newCluster >> 16;
+    entry.fileSize = 0; 
+
+    if (!updateEntry(fd, dir, index, &entry, bsi)) {
+        releaseCluster(fd, newCluster, bsi);
+        reply("Error writing new directory entry\n");
+    } else {
+        status("Directory created successfully\n");
+    }
+    metadataFlush(fd, bsi);
+}
+
+//function to handle the creation of the file
+void createFile(int fd, const char* fileName, DirectoryContext* context, BootSectorInfo* bsi) {
+    char name[256];
+    unsigned int dirCluster;
+    if (!resolveParent(fd, fileName, context, &dirCluster, name, bsi)) {
+        return;
+    }
+    char packed[11];
+    if (!packName(name, packed) || packed[0] == '.') {
+        reply("Error: Invalid file name: %s\n", fileName);
+        return;
+    }
+
+    DirCache* dir = loadDirectory(fd, dirCluster, bsi);
+    if (!dir) {
+        return;
+    }
+    if (findEntry(dir, packed) >= 0) {
+        reply("Error: A file or directory with this name already exists.\n");
+        return;
+    }
+
+    //search for a free entry, similar to mkdir
+    int index = findFreeEntry(dir);
+    if (index < 0) {
+        reply("No space in current directory to create new file\n");
+        return;
+    }
+
+    DirEntry entry;
+    memset(&entry, 0, sizeof(DirEntry)); 
+    memcpy(entry.name, packed, 11); 
+    entry.attr = 0x00; //file attribute
+    entry.firstClusterLow = 0; 
+    entry.firstClusterHigh = 0;
+    entry.fileSize = 0; 
+
+    if (!updateEntry(fd, dir, index, &entry, bsi)) {
+        reply("Error writing new file entry\n");
+    } else {
+        status("File created successfully\n");
+    }
+}
+
+//function to handle rm
+void removeFile(int fd, const char* fileName, DirectoryContext* context, BootSectorInfo* bsi) {
+    char name[256];
+    unsigned int dirCluster;
+    if (!resolveParent(fd, fileName, context, &dirCluster, name, bsi)) {
+        return;
+    }
+    char packed[11];
+    DirCache* dir = NULL;
+    int index = -1;
+
+    //search for entry to delete
+    if (packName(name, packed) && (dir = loadDirectory(fd, dirCluster, bsi))) {
+        index = findEntry(dir, packed);
+    }
+    if (index < 0 || (dir->entries[index].attr & ATTR_DIRECTORY)) {
+        reply("Error: File not found.\n");
+        return;
+    }
+    if (fileIsOpen(dir->cluster, index)) {
+        reply("Error: File is open, close it first.\n");
+        return;
+    }
+
+    //mark the deleted entry as deleted, then give its clusters back
+    DirEntry entry = dir->entries[index];
+    entry.name[0] = 0xE5; 
+
+    if (!updateEntry(fd, dir, index, &entry, bsi)) {
+        reply("Error writing updated directory entry\n");
+        return;
+    }
+    releaseChain(fd, entryCluster(&entry), bsi);
+    metadataFlush(fd, bsi);
+    status("File removed successfully\n");
+}
+
+//function to handle rmdir
+void removeDirectory(int fd, const char* dirName, DirectoryContext* context, BootSectorInfo* bsi) {
+    char name[256];
+    unsigned int parentDir;
+    if (!resolveParent(fd, dirName, context, &parentDir, name, bsi)) {
+        return;
+    }
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || name[0] == '\0') {
+        reply("Error: Cannot remove '.' or '..'\n");
+        return;
+    }
+
+    //search for directory with packed name, deleted directories are not indexed
+    char packed[11];
+    DirCache* dir = NULL;
+    int index = -1;
+    if (packName(name, packed) && (dir = loadDirectory(fd, parentDir, bsi))) {
+        index = findEntry(dir, packed);
+    }
+    if (index < 0 || !(dir->entries[index].attr & ATTR_DIRECTORY)) {
+        reply("Error: Directory not found.\n");
+        return;
+    }
+
+    //check if the directory is empty: only '.' and '..' may be live
+    unsigned int dirCluster = entryCluster(&dir->entries[index]);
+    unsigned int parentCluster = dir->cluster;
+    //the caller's own context is checked too, it may not be registered (the benchmark)
+    bool inUse = dirCluster == context->currentCluster || directoryInUse(dirCluster);
+    for (int i = 0; i < context->depth; i++) {
+        inUse = inUse || context->parents[i] == dirCluster;
+    }
+    if (inUse) {
+        reply("Error: Cannot remove a directory that a session is in or below.\n");
+        return;
+    }
+    bool isEmpty = true;
+    DirCache* child = dirCluster >= 2 ? loadDirectory(fd, dirCluster, bsi) : NULL;
+    if (!child) {
+        isEmpty = false; 
+    } else {
+        for (unsigned int j = 0; j < child->endIndex; j++) {
+            if ((unsigned char)child->entries[j].name[0] == 0xE5 || child->entries[j].name[0] == '.') {
+                continue; 
+            }
+            isEmpty = false;
+            break;
+        }
+    }
+
+    if (!isEmpty) {
+        reply("Error: Directory is not empty or could not be read.\n");
+        return;
+    }
+
+    //loading the child may have evicted the parent
+    dir = loadDirectory(fd, parentCluster, bsi);
+    if (!dir) {
+        return;
+    }
+
+    //mark the directory as deleted, drop it from the cache and free its chain
+    DirEntry entry = dir->entries[index];
+    entry.name[0] = 0xE5; 
+    invalidateDirectory(dirCluster);
+
+    if (!updateEntry(fd, dir, index, &entry, bsi)) {
+        reply("Error writing updated directory\n");
+        return;
+    }
+    releaseChain(fd, dirCluster, bsi);
+    metadataFlush(fd, bsi);
+    status("Directory removed successfully\n");
+}
+
+//clusters and directories found under a directory that rm -r is about to delete
+typedef struct {
+    uint64_t* clusters;         //one bit per cluster of every chain in the subtree
+    unsigned int* dirs;         //first clusters of the directories, the walk's work list
+    unsigned int dirCount;
+    unsigned int dirCapacity;
+    unsigned int files;
+    unsigned int clusterCount;
+} RemoveSet;
+
+//add a chain to the set, stopping at a cluster that is already in it (loops and cross links)
+static void removeSetChain(int fd, RemoveSet* set, unsigned int head, BootSectorInfo* bsi) {
+    unsigned int cluster = head;
+    while (cluster >= 2 && cluster < bsi->maxCluster) {
+        uint64_t bit = (uint64_t)1 << (cluster % 64);
+        if (set->clusters[cluster / 64] & bit) {
+            return;
+        }
+        set->clusters[cluster / 64] |= bit;
+        set->clusterCount++;
+        cluster = getNextCluster(fd, cluster, bsi);
+    }
+}
+
+//walk the subtree below root breadth first, collecting every chain
+//fails if a file in it is open
+static bool collectRemoveSet(int fd, unsigned int root, RemoveSet* set, BootSectorInfo* bsi) {
+    removeSetChain(fd, set, root, bsi);
+    set->dirs[set->dirCount++] = root;
+    for (unsigned int d = 0; d < set->dirCount; d++) {
+        DirCache* dc = loadDirectory(fd, set->dirs[d], bsi);
+        if (!dc) {
+            return false;
+        }
+        for (unsigned int i = 0; i < dc->endIndex; i++) {
+            DirEntry* entry = &dc->entries[i];
+            if ((unsigned char)entry->name[0] == 0xE5 || entry->name[0] == '.' || entry->attr == 0x0F || (entry->attr & 0x08)) {
+                continue;
+            }
+            unsigned int head = entryCluster(entry);
+            if (!(entry->attr & ATTR_DIRECTORY)) {
+                if (fileIsOpen(dc->cluster, i)) {
+                    char name[13];
+                    formatEntryName(entry, name);
+                    reply("Error: %s is open, close it first.\n", name);
+                    return false;
+                }
+                removeSetChain(fd, set, head, bsi);
+                set->files++;
+                continue;
+            }
+            //a directory already in the set, or the root, is a loop in a corrupted tree
+            if (head < 2 || head >= bsi->maxCluster || head == bsi->rootCluster || (set->clusters[head / 64] >> (head % 64)) & 1) {
+                continue;
+            }
+            if (set->dirCount == set->dirCapacity) {
+                unsigned int capacity = set->dirCapacity * 2;
+                unsigned int* grown = realloc(set->dirs, capacity * sizeof(unsigned int));
+                if (!grown) {
+                    reply("Error: Not enough memory to remove the tree\n");
+                    return false;
+                }
+                set->dirs = grown;
+                set->dirCapacity = capacity;
+            }
+            removeSetChain(fd, set, head, bsi);
+            set->dirs[set->dirCount++] = head;
+        }
+    }
+    return true;
+}
+
+//function to handle rm -r: delete a directory and everything below it
+//only the top entry is rewritten, the subtree's clusters are freed in one ascending pass over the FAT
+void removeTree(int fd, const char* path, DirectoryContext* context, BootSectorInfo* bsi) {
+    char name[256], packed[11];
+    unsigned int parentDir;
+    if (!resolveParent(fd, path, context, &parentDir, name, bsi)) {
+        return;
+    }
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || name[0] == '\0') {
+        reply("Error: Cannot remove '.' or '..'\n");
+        return;
+    }
+    DirCache* dir = NULL;
+    int index = -1;
+    if (packName(name, packed) && (dir = loadDirectory(fd, parentDir, bsi))) {
+        index = findEntry(dir, packed);
+    }
+    if (index < 0) {
+        reply("Error: File or directory not found.\n");
+        return;
+    }
+    if (!(dir->entries[index].attr & ATTR_DIRECTORY)) {
+        removeFile(fd, path, context, bsi);
+        return;
+    }
+
+    unsigned int root = entryCluster(&dir->entries[index]);
+    bool inUse = root == context->currentCluster || directoryInUse(root);
+    for (int i = 0; i < context->depth; i++) {
+        inUse = inUse || context->parents[i] == root;
+    }
+    if (inUse) {
+        reply("Error: Cannot remove a directory that a session is in or below.\n");
+        return;
+    }
+
+    RemoveSet set;
+    memset(&set, 0, sizeof(set));
+    set.clusters = calloc((bsi->maxCluster + 63) / 64, sizeof(uint64_t));
+    set.dirCapacity = 64;
+    set.dirs = malloc(set.dirCapacity * sizeof(unsigned int));
+    if (!set.clusters || !set.dirs) {
+        reply("Error: Not enough memory to remove the tree\n");
+    } else if (root >= 2 && collectRemoveSet(fd, root, &set, bsi) && (dir = loadDirectory(fd, parentDir, bsi))) {
+        //the walk may have evicted the parent, index is still valid because nothing was written
+        DirEntry entry = dir->entries[index];
+        entry.name[0] = 0xE5;
+        for (unsigned int d = 0; d < set.dirCount; d++) {
+            invalidateDirectory(set.dirs[d]);
+        }
+        if (!updateEntry(fd, dir, index, &entry, bsi)) {
+            reply("Error writing updated directory\n");
+        } else {
+            unsigned int freed = 0;
+            unsigned int words = (bsi->maxCluster + 63) / 64;
+            for (unsigned int w = 0; w < words; w++) {
+                for (uint64_t bits = set.clusters[w]; bits; bits &= bits - 1) {
+                    freed += releaseCluster(fd, w * 64 + __builtin_ctzll(bits), bsi);
+                }
+            }
+            metadataFlush(fd, bsi);
+            status("Removed %u files and %u directories, freed %u clusters\n", set.files, set.dirCount, freed);
+        }
+    }
+    free(set.clusters);
+    free(set.dirs);
+}
+
+//drop the extent map so the next access rebuilds it from the FAT
+void invalidateExtents(OpenFile* file) {
+    free(file->extents);
+    file->extents = NULL;
+    file->extentCount = 0;
+    file->extentCapacity = 0;
+    file->extentsValid = false;
+}
+
+//wait until every request of a read-ahead window has completed
+//if the ring broke, its buffer is abandoned because the kernel may still write into it
+static void readAheadWait(ReadAheadWindow* window) {
+#ifdef HAVE_IO_URING
+    IoRing* ring = &readAheadRing;
+    while (window->pending > 0) {
+        if (readAheadRingFailed) {
+            window->data = NULL;
+            window->pending = 0;
+            window->done = 0;
+            return;
+        }
+        activeStats->syscalls++;
+        if (syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+            perror("Error waiting for read-ahead");
+            readAheadRingFailed = true;
+            continue;
+        }
+        unsigned int head = *ring->cqHead;
+        while (head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cqMask];
+            ReadAheadWindow* owner = (ReadAheadWindow*)(uintptr_t)cqe->user_data;
+            if (cqe->res > 0) {
+                owner->done += cqe->res;
+            }
+            owner->pending--;
+            readAheadInFlight--;
+            head++;
+        }
+        __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+    }
+#else
+    (void)window;
+#endif
+}
+
+//forget everything read ahead for a file, after random access or when its data changes
+void readAheadDrop(OpenFile* file) {
+    if (file->ahead) {
+        for (int i = 0; i < 2; i++) {
+            readAheadWait(&file->ahead[i]);
+            file->ahead[i].len = 0;
+        }
+    }
+    file->readAhead = 0;
+    file->aheadEnd = 0;
+}
+
+//open files of the session running on this thread: slots are addressed by handle,
+//closed slots are chained on a free list and a hash on (directory cluster, entry index)
+//finds the handle of a file that is already open
+typedef struct {
+    OpenFile* files;
+    int* nextFree;              //free list links, -1 ends the list
+    int* chain;                 //key hash chains through open slots
+    int* buckets;
+    int freeHead;
+    unsigned int bucketMask;
+    unsigned int capacity;
+    unsigned int used;          //slots ever handed out, handles are below this
+} OpenFileTable;
+
+__thread OpenFileTable openTable = {NULL, NULL, NULL, NULL, -1, 0, 0, 0};
+
+//every open file of every session, so a file is open only once across the whole server
+//keyed like the session tables, owner is the openTable of the session holding the file;
+//changed only by open, close and session end, which run under the write side of imageLock
+typedef struct {
+    unsigned int dirCluster;
+    unsigned int entryIndex;
+    const OpenFileTable* owner;
+    int next;                   //bucket chain, or free list link once removed
+} OpenKey;
+
+typedef struct {
+    OpenKey* keys;
+    int* buckets;
+    int freeHead;
+    unsigned int bucketMask;
+    unsigned int capacity;
+    unsigned int used;
+} OpenRegistry;
+
+OpenRegistry openRegistry = {NULL, NULL, -1, 0, 0, 0};
+
+static unsigned int registryBucket(unsigned int dirCluster, unsigned int entryIndex) {
+    return ((dirCluster * 2654435761u) ^ (entryIndex * 40503u)) & openRegistry.bucketMask;
+}
+
+//the session table holding a file open, NULL if no session has it open
+const OpenFileTable* openOwner(unsigned int dirCluster, unsigned int entryIndex) {
+    if (openRegistry.capacity == 0) {
+        return NULL;
+    }
+    for (int k = openRegistry.buckets[registryBucket(dirCluster, entryIndex)]; k != -1; k = openRegistry.keys[k].next) {
+        if (openRegistry.keys[k].dirCluster == dirCluster && openRegistry.keys[k].entryIndex == entryIndex) {
+            return openRegistry.keys[k].owner;
+        }
+    }
+    return NULL;
+}
+
+//open in any session, rm and rm -r must not free its chain
+bool fileIsOpen(unsigned int dirCluster, unsigned int entryIndex) {
+    return openOwner(dirCluster, entryIndex) != NULL;
+}
+
+static bool registryAdd(unsigned int dirCluster, unsigned int entryIndex) {
+    int k = openRegistry.freeHead;
+    if (k >= 0) {
+        openRegistry.freeHead = openRegistry.keys[k].next;
+    } else {
+        if (openRegistry.used == openRegistry.capacity) {
+            //double both arrays and rehash the live keys
+            unsigned int capacity = openRegistry.capacity ? openRegistry.capacity * 2 : OPEN_TABLE_INITIAL;
+            OpenKey* keys = realloc(openRegistry.keys, capacity * sizeof(OpenKey));
+            if (!keys) return false;
+            openRegistry.keys = keys;
+            int* buckets = realloc(openRegistry.buckets, capacity * sizeof(int));
+            if (!buckets) return false;
+            openRegistry.buckets = buckets;
+            openRegistry.capacity = capacity;
+            openRegistry.bucketMask = capacity - 1;
+            memset(openRegistry.buckets, 0xFF, capacity * sizeof(int));
+            for (unsigned int i = 0; i < openRegistry.used; i++) {
+                if (openRegistry.keys[i].owner) {
+                    unsigned int bucket = registryBucket(openRegistry.keys[i].dirCluster, openRegistry.keys[i].entryIndex);
+                    openRegistry.keys[i].next = openRegistry.buckets[bucket];
+                    openRegistry.buckets[bucket] = i;
+                }
+            }
+        }
+        k = openRegistry.used++;
+    }
+    unsigned int bucket = registryBucket(dirCluster, entryIndex);
+    openRegistry.keys[k] = (OpenKey){dirCluster, entryIndex, &openTable, openRegistry.buckets[bucket]};
+    openRegistry.buckets[bucket] = k;
+    return true;
+}
+
+static void registryRemove(unsigned int dirCluster, unsigned int entryIndex) {
+    int* link = &openRegistry.buckets[registryBucket(dirCluster, entryIndex)];
+    while (*link != -1) {
+        OpenKey* key = &openRegistry.keys[*link];
+        if (key->dirCluster == dirCluster && key->entryIndex == entryIndex) {
+            int k = *link;
+            *link = key->next;
+            key->owner = NULL;
+            key->next = openRegistry.freeHead;
+            openRegistry.freeHead = k;
+            return;
+        }
+        link = &key->next;
+    }
+}
+
+static unsigned int openKeyBucket(unsigned int dirCluster, unsigned int entryIndex) {
+    return ((dirCluster * 2654435761u) ^ (entryIndex * 40503u)) & openTable.bucketMask;
+}
+
+//double the table and rebuild the key index over the open slots
+static bool growOpenTable() {
+    unsigned int capacity = openTable.capacity ? openTable.capacity * 2 : OPEN_TABLE_INITIAL;
+    OpenFile* files = realloc(openTable.files, capacity * sizeof(OpenFile));
+    if (!files) return false;
+    openTable.files = files;
+    int* nextFree = realloc(openTable.nextFree, capacity * sizeof(int));
+    if (!nextFree) return false;
+    openTable.nextFree = nextFree;
+    int* chain = realloc(openTable.chain, capacity * sizeof(int));
+    if (!chain) return false;
+    openTable.chain = chain;
+    int* buckets = realloc(openTable.buckets, capacity * sizeof(int));
+    if (!buckets) return false;
+    openTable.buckets = buckets;
+
+    memset(openTable.files + openTable.capacity, 0, (capacity - openTable.capacity) * sizeof(OpenFile));
+    openTable.capacity = capacity;
+    openTable.bucketMask = capacity - 1;
+    memset(openTable.buckets, 0xFF, capacity * sizeof(int));
+    for (unsigned int h = 0; h < openTable.used; h++) {
+        if (openTable.files[h].isOpen) {
+            unsigned int bucket = openKeyBucket(openTable.files[h].dirCluster, openTable.files[h].entryIndex);
+            openTable.chain[h] = openTable.buckets[bucket];
+            openTable.buckets[bucket] = h;
+        }
+    }
+    return true;
+}
+
+//slot for a newly opened file, reusing the most recently closed handle first
+int allocateHandle(unsigned int dirCluster, unsigned int entryIndex) {
+    if (!registryAdd(dirCluster, entryIndex)) {
+        reply("Error: Out of memory for the open file table.\n");
+        return -1;
+    }
+    int handle = openTable.freeHead;
+    if (handle >= 0) {
+        openTable.freeHead = openTable.nextFree[handle];
+    } else {
+        if (openTable.used == openTable.capacity && !growOpenTable()) {
+            reply("Error: Out of memory for the open file table.\n");
+            registryRemove(dirCluster, entryIndex);
+            return -1;
+        }
+        handle = openTable.used++;
+    }
+
+    OpenFile* file = &openTable.files[handle];
+    memset(file, 0, sizeof(OpenFile));
+    file->isOpen = true;
+    file->dirCluster = dirCluster;
+    file->entryIndex = entryIndex;
+    unsigned int bucket = openKeyBucket(dirCluster, entryIndex);
+    openTable.chain[handle] = openTable.buckets[bucket];
+    openTable.buckets[bucket] = handle;
+    return handle;
+}
+
+void releaseHandle(int handle) {
+    OpenFile* file = &openTable.files[handle];
+    int* link = &openTable.buckets[openKeyBucket(file->dirCluster, file->entryIndex)];
+    while (*link != handle) link = &openTable.chain[*link];
+    *link = openTable.chain[handle];
+    registryRemove(file->dirCluster, file->entryIndex);
+
+    invalidateExtents(file);
+    free(file->writeBuffer);
+    readAheadDrop(file);
+    if (file->ahead) {
+        free(file->ahead[0].data);
+        free(file->ahead[1].data);
+        free(file->ahead);
+    }
+    memset(file, 0, sizeof(OpenFile));
+    openTable.nextFree[handle] = openTable.freeHead;
+    openTable.freeHead = handle;
+}
+
+OpenFile* fileByHandle(long handle) {
+    if (handle < 0 || (unsigned long)handle >= openTable.used || !openTable.files[handle].isOpen) {
+        return NULL;
+    }
+    return &openTable.files[handle];
+}
+
+//handle of the open file behind a directory entry, or -1
+int handleByKey(unsigned int dirCluster, unsigned int entryIndex) {
+    if (openTable.capacity == 0) {
+        return -1;
+    }
+    int handle = openTable.buckets[openKeyBucket(dirCluster, entryIndex)];
+    while (handle != -1) {
+        OpenFile* file = &openTable.files[handle];
+        if (file->dirCluster == dirCluster && file->entryIndex == entryIndex) {
+            return handle;
+        }
+        handle = openTable.chain[handle];
+    }
+    return -1;
+}
+
+static bool isHandle(const char* arg) {
+    return arg[0] != '\0' && strspn(arg, "0123456789") == strlen(arg);
+}
+
+//the open file named by a handle number or by a path, or NULL (a file named "12" can be given as ./12)
+OpenFile* findOpenFile(int fd, const char* arg, DirectoryContext* context, BootSectorInfo* bsi) {
+    if (isHandle(arg)) {
+        return fileByHandle(strtol(arg, NULL, 10));
+    }
+    char name[256], packed[11];
+    unsigned int dirCluster;
+    DirCache* dir;
+    if (!resolveParent(fd, arg, context, &dirCluster, name, bsi) || !packName(name, packed) ||
+        !(dir = loadDirectory(fd, dirCluster, bsi))) {
+        return NULL;
+    }
+    int index = findEntry(dir, packed);
+    return index < 0 ? NULL : fileByHandle(handleByKey(dir->cluster, index));
+}
+
+//release the table itself, every file must be closed
+void freeOpenTable() {
+    free(openTable.files);
+    free(openTable.nextFree);
+    free(openTable.chain);
+    free(openTable.buckets);
+    memset(&openTable, 0, sizeof(openTable));
+    openTable.freeHead = -1;
+}
+
+//add the next cluster of the chain to the end of the extent map
+static bool appendExtent(OpenFile* file, unsigned int cluster, unsigned int clusterSize) {
+    Extent* last = file->extentCount ? &file->extents[file->extentCount - 1] : NULL;
+    if (last && last->firstCluster + last->clusterCount == cluster) {
+        last->clusterCount++;
+        return true;
+    }
+    if (file->extentCount == file->extentCapacity) {
+        unsigned int capacity = file->extentCapacity ? file->extentCapacity * 2 : 8;
+        Extent* grown = realloc(file->extents, capacity * sizeof(Extent));
+        if (!grown) {
+            reply("Failed to allocate memory for extent map\n");
+            return false;
+        }
+        file->extents = grown;
+        file->extentCapacity = capacity;
+        last = file->extentCount ? &file->extents[file->extentCount - 1] : NULL;
+    }
+    unsigned long fileOffset = last ? last->fileOffset + (unsigned long)last->clusterCount * clusterSize : 0;
+    file->extents[file->extentCount++] = (Extent){fileOffset, cluster, 1};
+    return true;
+}
+
+//walk the cluster chain once and record runs of contiguous clusters
+bool buildExtents(int fd, OpenFile* file, BootSectorInfo* bsi) {
+    invalidateExtents(file);
+    unsigned int clusterSize = bsi->bytesPerSector * bsi->sectorsPerCluster;
+    unsigned int hops = 0;
+    unsigned int cluster = file->cluster;
+
+    while (cluster >= 2 && cluster != 0xFFFFFFFF) {
+        //guard against loops in a corrupted chain
+        if (++hops > bsi->totalClusters) {
+            reply("Error: Cluster chain of %s loops\n", file->fileName);
+            invalidateExtents(file);
+            return false;
+        }
+        if (!appendExtent(file, cluster, clusterSize)) {
+            invalidateExtents(file);
+            return false;
+        }
+        cluster = getNextCluster(fd, cluster, bsi);
+    }
+
+    file->extentsValid = true;
+    return true;
+}
+
+//make sure the chain is long enough to hold size bytes, allocating and linking new clusters
+bool growChain(int fd, OpenFile* file, unsigned long size, BootSectorInfo* bsi) {
+    if (!file->extentsValid && !buildExtents(fd, file, bsi)) {
+        return false;
+    }
+    unsigned int clusterSize = bsi->bytesPerSector * bsi->sectorsPerCluster;
+    Extent* last = file->extentCount ? &file->extents[file->extentCount - 1] : NULL;
+    unsigned long allocated = last ? last->fileOffset + (unsigned long)last->clusterCount * clusterSize : 0;
+    if (size <= allocated) {
+        return true;
+    }
+
+    unsigned int count = (size - allocated + clusterSize - 1) / clusterSize;
+    unsigned int lastCluster = last ? last->firstCluster + last->clusterCount - 1 : 0;
+    unsigned int first = allocateClusters(fd, count, lastCluster, bsi);
+    if (first == 0) {
+        reply("Error: No free clusters left on the image\n");
+        return false;
+    }
+    if (file->cluster == 0) {
+        file->cluster = first;
+        file->entryDirty = true;
+    }
+
+    //extend the extent map with the new clusters instead of rebuilding it
+    unsigned int cluster = first;
+    for (unsigned int i = 0; i < count; i++) {
+        if (!appendExtent(file, cluster, clusterSize)) {
+            invalidateExtents(file);
+            return false;
+        }
+        cluster = getNextCluster(fd, cluster, bsi);
+    }
+    return true;
+}
+
+//translate a file offset to an image offset by binary search over the extents
+//contiguous receives how many bytes can be read from there without leaving the run
+//returns -1 if the offset lies past the end of the chain
+off_t mapFileOffset(int fd, OpenFile* file, unsigned long offset, size_t* contiguous, BootSectorInfo* bsi) {
+    if (!file->extentsValid && !buildExtents(fd, file, bsi)) {
+        return -1;
+    }
+
+    unsigned int clusterSize = bsi->bytesPerSector * bsi->sectorsPerCluster;
+    unsigned int lo = 0, hi = file->extentCount;
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if (file->extents[mid].fileOffset <= offset) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == 0) {
+        return -1;
+    }
+
+    Extent* ext = &file->extents[lo - 1];
+    unsigned long runBytes = (unsigned long)ext->clusterCount * clusterSize;
+    unsigned long within = offset - ext->fileOffset;
+    if (within >= runBytes) {
+        return -1;
+    }
+    if (contiguous) {
+        *contiguous = runBytes - within;
+    }
+    return clusterOffset(ext->firstCluster, bsi) + (off_t)within;
+}
+
+//copy len bytes starting at a file offset straight into dest
+//each physically contiguous run is one request, and the runs are read together as one batch
+//returns the number of bytes read (short if the chain ends early), or -1 on I/O error
+long readFileData(int fd, OpenFile* file, unsigned long offset, unsigned char* dest, unsigned long len, BootSectorInfo* bsi) {
+    IoBatch batch;
+    ioBatchInit(&batch, fd, false, &activeStats->syscalls);
+    unsigned long done = 0, queued = 0;
+    while (done < len) {
+        size_t contiguous;
+        off_t physical = mapFileOffset(fd, file, offset + done, &contiguous, bsi);
+        if (physical < 0) {
+            break;
+        }
+
+        size_t chunk = len - done;
+        if (chunk > contiguous) chunk = contiguous;
+
+        //pieces smaller than a cluster go through the shared cluster cache
+        unsigned int clusterSize = bsi->bytesPerSector * bsi->sectorsPerCluster;
+        off_t clusterStart = clusterOffset(offsetCluster(physical, bsi), bsi);
+        if (clusterCache.capacity > 0 && chunk < clusterSize && physical + (off_t)chunk <= clusterStart + (off_t)clusterSize) {
+            const unsigned char* cached = loadCachedCluster(fd, offsetCluster(physical, bsi), bsi);
+            if (!cached) {
+                return -1;
+            }
+            memcpy(dest + done, cached + (physical - clusterStart), chunk);
+        } else if (ioBatchAdd(&batch, dest + done, chunk, physical)) {
+            queued += chunk;
+        } else {
+            return -1;
+        }
+        done += chunk;
+    }
+    if (!ioBatchSubmit(&batch)) {
+        return -1;
+    }
+    activeStats->bytesRead += queued;
+    return (long)done;
+}
+
+//copy bytes at a file offset out of the read-ahead windows, waiting for them if still in flight
+//returns how many leading bytes were there, the caller reads the rest from the image
+unsigned long readAheadCopy(OpenFile* file, unsigned long offset, unsigned char* dest, unsigned long len) {
+    unsigned long copied = 0;
+    while (file->ahead && copied < len) {
+        ReadAheadWindow* window = NULL;
+        for (int i = 0; i < 2; i++) {
+            ReadAheadWindow* w = &file->ahead[i];
+            if (w->len && offset + copied >= w->start && offset + copied < w->start + w->len) {
+                window = w;
+            }
+        }
+        if (!window) {
+            break;
+        }
+        readAheadWait(window);
+        if (window->done != window->len) {
+            //a short or failed read, the image is read directly instead
+            window->len = 0;
+            break;
+        }
+        unsigned long from = offset + copied - window->start;
+        unsigned long chunk = window->len - from < len - copied ? window->len - from : len - copied;
+        memcpy(dest + copied, window->data + from, chunk);
+        copied += chunk;
+    }
+    return copied;
+}
+
+//keep the next window of a sequential reader in flight, doubling it each time up to READAHEAD_MAX_BYTES
+//without io_uring (or with -m) the kernel is asked to pull the window into the page cache instead
+void readAheadAdvance(int fd, OpenFile* file, BootSectorInfo* bsi) {
+    unsigned int clusterSize = bsi->bytesPerSector * bsi->sectorsPerCluster;
+    unsigned int maxClusters = READAHEAD_MAX_BYTES / clusterSize ? READAHEAD_MAX_BYTES / clusterSize : 1;
+    if (file->readAhead == 0) {
+        file->readAhead = READAHEAD_MIN_CLUSTERS < maxClusters ? READAHEAD_MIN_CLUSTERS : maxClusters;
+    }
+
+    //issue the next window once the reader is within half a window of the end of what is ahead
+    unsigned long windowBytes = (unsigned long)file->readAhead * clusterSize;
+    unsigned long start = file->aheadEnd > file->offset ? file->aheadEnd : file->offset;
+    if (start - file->offset > windowBytes / 2 || start >= file->size) {
+        return;
+    }
+    unsigned long len = file->size - start < windowBytes ? file->size - start : windowBytes;
+
+#ifdef HAVE_IO_URING
+    IoRing* ring = NULL;
+    if (ioQueueDepth > 0 && !readAheadRingFailed && !image.map) {
+        if (readAheadRing.fd < 0 && !ioRingSetup(&readAheadRing, ioQueueDepth)) {
+            readAheadRingFailed = true;
+        } else {
+            ring = &readAheadRing;
+        }
+    }
+    if (ring) {
+        //reuse a window the reader has moved past
+        if (!file->ahead && !(file->ahead = calloc(2, sizeof(ReadAheadWindow)))) {
+            return;
+        }
+        ReadAheadWindow* window = NULL;
+        for (int i = 0; i < 2 && !window; i++) {
+            ReadAheadWindow* w = &file->ahead[i];
+            if (w->pending == 0 && (w->len == 0 || w->start + w->len <= file->offset)) {
+                window = w;
+            }
+        }
+        if (!window || (!window->data && !(window->data = malloc(READAHEAD_MAX_BYTES > clusterSize ? READAHEAD_MAX_BYTES : clusterSize)))) {
+            return;
+        }
+
+        //one request per contiguous run, the window ends early if the ring is full
+        window->start = start;
+        window->done = 0;
+        unsigned long queued = 0;
+        unsigned int tail = *ring->sqTail, submit = 0;
+        while (queued < len && readAheadInFlight < ring->entries) {
+            size_t contiguous;
+            off_t physical = mapFileOffset(fd, file, start + queued, &contiguous, bsi);
+            if (physical < 0) {
+                break;
+            }
+            size_t piece = len - queued < contiguous ? len - queued : contiguous;
+            struct io_uring_sqe* sqe = &ring->sqes[tail & *ring->sqMask];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = fd;
+            sqe->addr = (unsigned long)(window->data + queued);
+            sqe->len = piece;
+            sqe->off = physical;
+            sqe->user_data = (uintptr_t)window;
+            ring->sqArray[tail & *ring->sqMask] = tail & *ring->sqMask;
+            tail++;
+            submit++;
+            queued += piece;
+            window->pending++;
+            readAheadInFlight++;
+        }
+        window->len = queued;
+        if (submit == 0) {
+            return;
+        }
+        __atomic_store_n(ring->sqTail, tail, __ATOMIC_RELEASE);
+        activeStats->syscalls++;
+        activeStats->bytesRead += queued;
+        if (syscall(__NR_io_uring_enter, ring->fd, submit, 0, 0, NULL, 0) < 0) {
+            perror("Error starting read-ahead");
+            readAheadRingFailed = true;
+        }
+        len = queued;
+    } else
+#endif
+    {
+        for (unsigned long done = 0; done < len; ) {
+            size_t contiguous;
+            off_t physical = mapFileOffset(fd, file, start + done, &contiguous, bsi);
+            if (physical < 0) {
+                break;
+            }
+            size_t piece = len - done < contiguous ? len - done : contiguous;
+            imagePrefetch(fd, physical, piece);
+            done += piece;
+        }
+    }
+
+    file->aheadEnd = start + len;
+    if (file->readAhead * 2 <= maxClusters) {
+        file->readAhead *= 2;
+    }
+}
+
+//write the buffered dirty bytes of a file to its clusters, growing the chain first
+bool flushWriteBuffer(int fd, OpenFile* file, BootSectorInfo* bsi) {
+    if (file->dirtyEnd <= file->dirtyStart) {
+        return true;
+    }
+    if (!growChain(fd, file, file->dirtyEnd, bsi)) {
+        return false;
+    }
+
+    //the dirty range never leaves one cluster, so it is one write
+    off_t physical = mapFileOffset(fd, file, file->dirtyStart, NULL, bsi);
+    size_t len = file->dirtyEnd - file->dirtyStart;
+    const unsigned char* pending = file->writeBuffer + (file->dirtyStart - file->bufferStart);
+    if (physical < 0 || !imageWrite(fd, pending, len, physical)) {
+        return false;
+    }
+    imageSync(physical, len);
+    unsigned int cluster = offsetCluster(physical, bsi);
+    clusterCachePatch(cluster, physical - clusterOffset(cluster, bsi), pending, len);
+    file->dirtyStart = file->dirtyEnd = 0;
+    return true;
+}
+
+//write the file's pending data, then its directory entry, FAT and FSInfo
+bool flushOpenFile(int fd, OpenFile* file, BootSectorInfo* bsi) {
+    bool ok = flushWriteBuffer(fd, file, bsi);
+
+    if (file->entryDirty) {
+        DirCache* dir = loadDirectory(fd, file->dirCluster, bsi);
+        if (!dir || file->entryIndex >= dir->endIndex || (unsigned char)dir->entries[file->entryIndex].name[0] == 0xE5) {
+            reply("Error: Directory entry for %s is gone\n", file->fileName);
+            ok = false;
+        } else {
+            DirEntry entry = dir->entries[file->entryIndex];
+            entry.fileSize = file->size;
+            entry.firstClusterHigh = file->cluster >> 16;
+            entry.firstClusterLow = file->cluster & 0xFFFF;
+            if (updateEntry(fd, dir, file->entryIndex, &entry, bsi)) {
+                file->entryDirty = false;
+            } else {
+                ok = false;
+            }
+        }
+    }
+
+    if (!metadataFlush(fd, bsi)) {
+        ok = false;
+    }
+    return ok;
+}
+
+//flush every open file, used by the flush command and on exit
+void flushAllOpenFiles(int fd, BootSectorInfo* bsi) {
+    for (unsigned int h = 0; h < openTable.used; h++) {
+        if (openTable.files[h].isOpen && !flushOpenFile(fd, &openTable.files[h], bsi)) {
+            reply("Error flushing file: %s\n", openTable.files[h].fileName);
+        }
+    }
+}
+
+//stage bytes in the file's one-cluster write-behind buffer
+//the buffer is written out when a write leaves its cluster or fills it
+bool bufferedWrite(int fd, OpenFile* file, unsigned long offset, const char* data, unsigned long len, BootSectorInfo* bsi) {
+    unsigned int clusterSize = bsi->bytesPerSector * bsi->sectorsPerCluster;
+    if (!file->writeBuffer) {
+        file->writeBuffer = malloc(clusterSize);
+        if (!file->writeBuffer) {
+            reply("Failed to allocate memory for write buffer\n");
+            return false;
+        }
+        file->dirtyStart = file->dirtyEnd = 0;
+    }
+
+    while (len > 0) {
+        unsigned long window = offset - offset % clusterSize;
+        size_t chunk = clusterSize - offset % clusterSize;
+        if (chunk > len) chunk = len;
+
+        //only extend the dirty range when the new bytes touch it
+        bool dirty = file->dirtyEnd > file->dirtyStart;
+        if (dirty && (window != file->bufferStart || offset < file->dirtyStart || offset > file->dirtyEnd)) {
+            if (!flushWriteBuffer(fd, file, bsi)) {
+                return false;
+            }
+            dirty = false;
+        }
+        if (!dirty) {
+            file->bufferStart = window;
+            file->dirtyStart = file->dirtyEnd = offset;
+        }
+
+        memcpy(file->writeBuffer + (offset - window), data, chunk);
+        if (offset + chunk > file->dirtyEnd) {
+            file->dirtyEnd = offset + chunk;
+        }
+        offset += chunk;
+        data += chunk;
+        len -= chunk;
+
+        //a full cluster goes out right away
+        if (file->dirtyStart == window && file->dirtyEnd == window + clusterSize && !flushWriteBuffer(fd, file, bsi)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//function to handle opening a file
+void openFile(int fd, const char* fileName, const char* mode, DirectoryContext* context, BootSectorInfo* bsi) {
+    //set flags based on mode
+    int flags = -1;
+    if (strcmp(mode, "-r") == 0) flags = 0;
+    else if (strcmp(mode, "-w") == 0) flags = 1;
+    else if (strcmp(mode, "-rw") == 0 || strcmp(mode, "-wr") == 0) flags = 2;
+
+    if (flags == -1) {
+        reply("Error: Invalid mode.\n");
+        return;
+    }
+
+    //find the file in the directory named by the path
+    char name[256];
+    unsigned int dirCluster;
+    if (!resolveParent(fd, fileName, context, &dirCluster, name, bsi)) {
+        return;
+    }
+    char packed[11];
+    DirCache* dir = NULL;
+    int entryIndex = -1;
+    if (packName(name, packed) && (dir = loadDirectory(fd, dirCluster, bsi))) {
+        entryIndex = findEntry(dir, packed);
+    }
+
+    //print message indicating success or failure
+    if (entryIndex < 0 || (dir->entries[entryIndex].attr & ATTR_DIRECTORY)) {
+        reply("Error: File not found.\n");
+        return;
+    }
+
+    //the same entry can only be open once, whatever path or session reached it
+    const OpenFileTable* owner = openOwner(dir->cluster, entryIndex);
+    if (owner) {
+        reply(owner == &openTable ? "Error: File is already opened.\n" : "Error: File is already opened by another session.\n");
+        return;
+    }
+
+    DirEntry* entry = &dir->entries[entryIndex];
+    int handle = allocateHandle(dir->cluster, entryIndex);
+    if (handle < 0) {
+        return;
+    }
+    OpenFile* file = &openTable.files[handle];
+    strncpy(file->fileName, fileName, sizeof(file->fileName) - 1);
+    file->flags = flags;
+    file->offset = 0;
+    file->cluster = entryCluster(entry);
+    file->size = entry->fileSize;
+    status("File opened successfully: %s (handle %d)\n", fileName, handle);
+}
+
+//function to handles closing of a file
+void closeFile(int fd, const char* fileName, DirectoryContext* context, BootSectorInfo* bsi) {
+    OpenFile* file = findOpenFile(fd, fileName, context, bsi);
+    if (!file) {
+        reply("Error: File not found or not opened.\n");
+        return;
+    }
+    if (!flushOpenFile(fd, file, bsi)) {
+        reply("Error: Pending writes to %s could not be saved\n", fileName);
+    }
+    releaseHandle(file - openTable.files);
+    status("File closed successfully: %s\n", fileName);
+}
+
+//function to list all open files
+void listOpenFiles(DirectoryContext* context) {
+    bool anyFileOpen = false;
+    reply("Opened Files:\n");
+    for (unsigned int h = 0; h < openTable.used; h++) {
+        OpenFile* file = &openTable.files[h];
+        if (file->isOpen) {
+            anyFileOpen = true;
+            const char* modeString;
+            switch (file->flags) {
+                case 0: modeString = "Read-Only"; break;
+                case 1: modeString = "Write-Only"; break;
+                case 2: modeString = "Read-Write"; break;
+                default: modeString = "Unknown"; break;
+            }
+            reply("Handle: %u, File: %s, Mode: %s, Offset: %lu, Path: %s\n",
+                   h, file->fileName, modeString, file->offset, context->path);
+        }
+    }
+
+    if (!anyFileOpen) {
+        reply("No files are currently opened.\n");
+    }
+}
+
+//seek the offset of the file
+void seekFile(int fd, const char* fileName, unsigned long newOffset, DirectoryContext* context, BootSectorInfo* bsi) {
+    OpenFile* file = findOpenFile(fd, fileName, context, bsi);
+    if (!file) {
+        reply("Error: File not found or not opened.\n");
+    } else if (newOffset > file->size) {
+        reply("Error: Offset is larger than the size of the file.\n");
+    } else {
+        file->offset = newOffset;
+        status("Offset set to %lu for file: %s\n", newOffset, fileName);
+    }
+}
+
+//function to handle reading of a file
+void readFile(int fd, const char* fileName, unsigned int size, DirectoryContext* context, BootSectorInfo* bsi) {
+    OpenFile* file = findOpenFile(fd, fileName, context, bsi);
+    if (!file) {
+        reply("Error: File not found or not opened.\n");
+        return;
+    }
+    if (file->flags == 1) {
+        reply("Error: File is not opened for reading.\n");
+        return;
+    }
+
+    //buffered writes must reach the image before they can be read back
+    if (!flushWriteBuffer(fd, file, bsi)) {
+        reply("Error writing buffered data\n");
+        return;
+    }
+
+    unsigned int readSize = size;
+    if (file->offset + size > file->size) {
+        readSize = file->size - file->offset;
+    }
+
+    //a read that does not continue where the last one ended collapses the read-ahead window
+    bool sequential = file->offset == file->nextOffset;
+    if (!sequential) {
+        readAheadDrop(file);
+    }
+
+    //stream through a bounded staging buffer instead of allocating the requested size
+    unsigned int stagingSize = readSize < READ_STAGING_SIZE ? readSize : READ_STAGING_SIZE;
+    unsigned char* buffer = arenaAlloc(stagingSize ? stagingSize : 1);
+    if (!buffer) {
+        return;
+    }
+
+    long bytesRead = 0;
+    while ((unsigned long)bytesRead < readSize) {
+        unsigned long chunk = readSize - bytesRead;
+        if (chunk > stagingSize) chunk = stagingSize;
+
+        unsigned long ahead = readAheadCopy(file, file->offset + bytesRead, buffer, chunk);
+        long n = ahead == chunk ? 0 : readFileData(fd, file, file->offset + bytesRead + ahead, buffer + ahead, chunk - ahead, bsi);
+        if (n < 0) {
+            reply("Error reading file\n");
+            break;
+        }
+        n += ahead;
+        reply("%.*s", (int)n, buffer); 
+        bytesRead += n;
+        if ((unsigned long)n < chunk) {
+            reply("Error: Cluster chain is shorter than the file size.\n");
+            break;
+        }
+    }
+
+    //update offset
+    file->offset += bytesRead;
+    file->nextOffset = file->offset;
+    if (sequential) {
+        readAheadAdvance(fd, file, bsi);
+    }
+    status("\nRead %ld bytes from file: %s\n", bytesRead, fileName);
+}
+
+//fucntion to handle finidng of the next cluster
+unsigned int getNextCluster(int fd, unsigned int currentCluster, BootSectorInfo* bsi) {
+    if (currentCluster < 2) {
+        fprintf(stderr, "Invalid cluster number: %u\n", currentCluster);
+        return 0xFFFFFFFF; //error
+    }
+
+    //FAT32 cluster entry is 4 bytes, served from the FAT cache
+    activeStats->fatLookups++;
+    unsigned int nextCluster = fatGet(fd, currentCluster, bsi);
+    if (nextCluster == 0xFFFFFFFF) {
+        return 0xFFFFFFFF;
+    }
+
+    //end of cluster chain markers
+    if (nextCluster >= 0x0FFFFFF8) {
+        return 0xFFFFFFFF; 
+    }
+    return nextCluster;
+}
+
+//function to handle writing to a file at its current offset
+//data is staged in the write-behind buffer and reaches the image on close, flush or exit
+void writeFile(int fd, const char* fileName, const char* data, DirectoryContext* context, BootSectorInfo* bsi) {
+    OpenFile* file = findOpenFile(fd, fileName, context, bsi);
+    if (!file) {
+        reply("Error: File not found or not opened.\n");
+        return;
+    }
+    if (file->flags == 0) {
+        reply("Error: File is not opened for writing.\n");
+        return;
+    }
+
+    unsigned long dataSize = strlen(data);
+    unsigned long newOffset = file->offset + dataSize;
+    if (newOffset > 0xFFFFFFFFUL) {
+        reply("Error: Write would exceed the 4 GB FAT32 file size limit.\n");
+        return;
+    }
+
+    //anything read ahead may now be stale
+    readAheadDrop(file);
+    if (!bufferedWrite(fd, file, file->offset, data, dataSize, bsi)) {
+        reply("Error writing to file\n");
+        return;
+    }
+
+    //check if the offset exceeds the file size and adjust file size 
+    if (newOffset > file->size) {
+        file->size = newOffset;  
+        file->entryDirty = true;
+    }
+    file->offset = newOffset;
+    status("Data written successfully to file: %s\n", fileName);
+}
+
+//state shared by the fsck worker threads
+//the FAT is read once into memory, the bitmaps are updated with atomic ors
+typedef struct {
+    unsigned int cluster;
+    char path[512];
+} FsckDir;
+
+typedef struct {
+    int fd;
+    BootSectorInfo* bsi;
+    unsigned int threads;
+    uint32_t* fat;              //first FAT copy, indexed by cluster
+    uint64_t* referenced;       //clusters some FAT entry points to
+    uint64_t* shared;           //clusters more than one FAT entry points to
+    uint64_t* reachable;        //clusters reached from the directory tree
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    FsckDir* queue;             //directories waiting to be scanned
+    unsigned int queueCount;
+    unsigned int queueCapacity;
+    unsigned int busy;          //workers currently scanning a directory
+    bool failed;
+
+    unsigned long long mirrorMismatches;
+    unsigned long long badPointers;
+    unsigned long long crossLinked;
+    unsigned long long sizeMismatches;
+    unsigned long long lostClusters;
+    unsigned long long lostChains;
+    unsigned long long usedClusters;
+    unsigned long long files;
+    unsigned long long directories;
+    unsigned long long syscalls;
+    unsigned long long bytesRead;
+    unsigned int reports;
+    FILE* out;                  //the issuing session's output
+} FsckState;
+
+typedef struct {
+    FsckState* st;
+    unsigned int first;         //cluster range of this worker's FAT slice
+    unsigned int last;
+} FsckWorker;
+
+//set a bit and return whether it was already set
+static bool fsckMark(uint64_t* bitmap, unsigned int cluster) {
+    uint64_t bit = 1ULL << (cluster % 64);
+    return __atomic_fetch_or(&bitmap[cluster / 64], bit, __ATOMIC_RELAXED) & bit;
+}
+
+static bool fsckTest(const uint64_t* bitmap, unsigned int cluster) {
+    return (__atomic_load_n(&bitmap[cluster / 64], __ATOMIC_RELAXED) >> (cluster % 64)) & 1;
+}
+
+//count a problem and print the first few of them
+static void fsckProblem(FsckState* st, unsigned long long* counter, const char* format, ...) {
+    pthread_mutex_lock(&st->lock);
+    (*counter)++;
+    if (st->reports++ < FSCK_MAX_REPORTS) {
+        va_list args;
+        va_start(args, format);
+        vfprintf(st->out, format, args);
+        va_end(args);
+    } else if (st->reports == FSCK_MAX_REPORTS + 1) {
+        fprintf(st->out, "  (further problems are only counted)\n");
+    }
+    pthread_mutex_unlock(&st->lock);
+}
+
+//load this slice of the FAT, compare the mirrors and record which clusters are pointed to
+static void* fsckFatWorker(void* arg) {
+    FsckWorker* w = arg;
+    FsckState* st = w->st;
+    BootSectorInfo* bsi = st->bsi;
+    unsigned long long syscalls = 0, bytesRead = 0;
+    size_t count = w->last - w->first;
+    off_t fatStart = (off_t)bsi->reservedSectors * bsi->bytesPerSector;
+
+    if (count == 0) {
+        return NULL;
+    }
+    if (!imageReadShared(st->fd, st->fat + w->first, count * 4, fatStart + (off_t)w->first * 4, &syscalls)) {
+        st->failed = true;
+        return NULL;
+    }
+    bytesRead += count * 4;
+
+    //mirror copies are compared in chunks so each thread needs only a small buffer
+    uint32_t* mirror = malloc(FSCK_CHUNK_ENTRIES * 4);
+    if (!mirror) {
+        st->failed = true;
+        return NULL;
+    }
+    for (unsigned int copy = 1; copy < bsi->numFATs; copy++) {
+        off_t copyStart = ((off_t)bsi->reservedSectors + (off_t)copy * bsi->sectorsPerFAT) * bsi->bytesPerSector;
+        for (size_t done = 0; done < count; done += FSCK_CHUNK_ENTRIES) {
+            size_t n = count - done < FSCK_CHUNK_ENTRIES ? count - done : FSCK_CHUNK_ENTRIES;
+            if (!imageReadShared(st->fd, mirror, n * 4, copyStart + (off_t)(w->first + done) * 4, &syscalls)) {
+                st->failed = true;
+                break;
+            }
+            bytesRead += n * 4;
+            for (size_t i = 0; i < n; i++) {
+                unsigned int cluster = w->first + done + i;
+                if (cluster >= 2 && (mirror[i] & FAT_ENTRY_MASK) != (st->fat[cluster] & FAT_ENTRY_MASK)) {
+                    fsckProblem(st, &st->mirrorMismatches, "FAT copy %u differs at cluster %u (%u vs %u)\n",
+                                copy + 1, cluster, mirror[i] & FAT_ENTRY_MASK, st->fat[cluster] & FAT_ENTRY_MASK);
+                }
+            }
+        }
+    }
+    free(mirror);
+
+    unsigned long long used = 0;
+    for (unsigned int cluster = w->first < 2 ? 2 : w->first; cluster < w->last; cluster++) {
+        uint32_t next = st->fat[cluster] & FAT_ENTRY_MASK;
+        if (next == 0 || next == FAT_BAD_CLUSTER) {
+            continue;
+        }
+        used++;
+        if (next >= 0x0FFFFFF8) {
+            continue;
+        }
+        if (next < 2 || next >= bsi->maxCluster) {
+            fsckProblem(st, &st->badPointers, "Cluster %u points outside the data region (%u)\n", cluster, next);
+        } else if (fsckMark(st->referenced, next)) {
+            fsckMark(st->shared, next);
+        }
+    }
+
+    pthread_mutex_lock(&st->lock);
+    st->usedClusters += used;
+    st->syscalls += syscalls;
+    st->bytesRead += bytesRead;
+    pthread_mutex_unlock(&st->lock);
+    return NULL;
+}
+
+//follow a chain through the in-memory FAT, marking every cluster reachable
+//stops at the first cluster that was already claimed, which is how cross links and loops show up
+static unsigned int fsckWalkChain(FsckState* st, unsigned int head, const char* path, unsigned int** clusters) {
+    BootSectorInfo* bsi = st->bsi;
+    unsigned int length = 0, capacity = 0;
+    unsigned int cluster = head;
+
+    while (true) {
+        if (fsckMark(st->reachable, cluster)) {
+            fsckProblem(st, &st->crossLinked, "%s: cluster %u is cross-linked\n", path, cluster);
+            break;
+        }
+        if (clusters) {
+            if (length == capacity) {
+                capacity = capacity ? capacity * 2 : 16;
+                unsigned int* grown = realloc(*clusters, capacity * sizeof(unsigned int));
+                if (!grown) {
+                    st->failed = true;
+                    break;
+                }
+                *clusters = grown;
+            }
+            (*clusters)[length] = cluster;
+        }
+        length++;
+
+        uint32_t next = st->fat[cluster] & FAT_ENTRY_MASK;
+        if (next >= 0x0FFFFFF8) {
+            break;
+        }
+        if (next == 0) {
+            fsckProblem(st, &st->badPointers, "%s: chain runs into free cluster after %u\n", path, cluster);
+            break;
+        }
+        if (next < 2 || next >= bsi->maxCluster) {
+            //already counted by the FAT pass
+            break;
+        }
+        cluster = next;
+    }
+    return length;
+}
+
+static void fsckQueueDirectory(FsckState* st, unsigned int cluster, const char* path) {
+    pthread_mutex_lock(&st->lock);
+    if (st->queueCount == st->queueCapacity) {
+        unsigned int capacity = st->queueCapacity ? st->queueCapacity * 2 : 64;
+        FsckDir* grown = realloc(st->queue, capacity * sizeof(FsckDir));
+        if (!grown) {
+            st->failed = true;
+            pthread_mutex_unlock(&st->lock);
+            return;
+        }
+        st->queue = grown;
+        st->queueCapacity = capacity;
+    }
+    st->queue[st->queueCount].cluster = cluster;
+    snprintf(st->queue[st->queueCount].path, sizeof(st->queue[0].path), "%.*s", (int)sizeof(st->queue[0].path) - 1, path);
+    st->queueCount++;
+    pthread_cond_signal(&st->wake);
+    pthread_mutex_unlock(&st->lock);
+}
+
+//check one directory: its own chain, every file chain in it, and queue its subdirectories
+static void fsckScanDirectory(FsckState* st, const FsckDir* dir, unsigned char* buffer, unsigned long long* syscalls,
+                              unsigned long long* bytesRead, unsigned long long* files) {
+    BootSectorInfo* bsi = st->bsi;
+    unsigned int clusterSize = bsi->bytesPerSector * bsi->sectorsPerCluster;
+    unsigned int* clusters = NULL;
+    unsigned int count = fsckWalkChain(st, dir->cluster, dir->path, &clusters);
+
+    for (unsigned int c = 0; c < count; c++) {
+        if (!imageReadShared(st->fd, buffer, clusterSize, clusterOffset(clusters[c], bsi), syscalls)) {
+            st->failed = true;
+            break;
+        }
+        *bytesRead += clusterSize;
+
+        bool end = false;
+        for (unsigned int i = 0; i < clusterSize / DIR_ENTRY_SIZE; i++) {
+            DirEntry* entry = (DirEntry*)(buffer + i * DIR_ENTRY_SIZE);
+            if (entry->name[0] == 0) {
+                end = true;
+                break;
+            }
+            if ((unsigned char)entry->name[0] == 0xE5 || entry->name[0] == '.' ||
+                entry->attr == 0x0F || (entry->attr & 0x08)) {
+                continue;
+            }
+
+            char name[13], path[sizeof(dir->path) + sizeof(name)];
+            formatEntryName(entry, name);
+            snprintf(path, sizeof(path), "%s%s%s", dir->path, strcmp(dir->path, "/") == 0 ? "" : "/", name);
+            unsigned int head = entryCluster(entry);
+
+            if (head != 0 && (head < 2 || head >= bsi->maxCluster)) {
+                fsckProblem(st, &st->badPointers, "%s: first cluster %u is outside the data region\n", path, head);
+                continue;
+            }
+            if (entry->attr & ATTR_DIRECTORY) {
+                if (head == 0) {
+                    fsckProblem(st, &st->badPointers, "%s: directory has no clusters\n", path);
+                } else {
+                    fsckQueueDirectory(st, head, path);
+                }
+                continue;
+            }
+
+            (*files)++;
+            unsigned int length = head ? fsckWalkChain(st, head, path, NULL) : 0;
+            unsigned long long expected = ((unsigned long long)entry->fileSize + clusterSize - 1) / clusterSize;
+            if (length != expected) {
+                fsckProblem(st, &st->sizeMismatches, "%s: size %u needs %llu clusters, chain has %u\n",
+                            path, entry->fileSize, expected, length);
+            }
+        }
+        if (end) {
+            break;
+        }
+    }
+    free(clusters);
+}
+
+//pull directories off the shared queue until every worker is idle and the queue is empty
+static void* fsckTreeWorker(void* arg) {
+    FsckState* st = ((FsckWorker*)arg)->st;
+    unsigned long long syscalls = 0, bytesRead = 0, files = 0, directories = 0;
+    unsigned char* buffer = malloc(st->bsi->bytesPerSector * st->bsi->sectorsPerCluster);
+    if (!buffer) {
+        st->failed = true;
+    }
+
+    pthread_mutex_lock(&st->lock);
+    while (buffer) {
+        while (st->queueCount == 0 && st->busy > 0) {
+            pthread_cond_wait(&st->wake, &st->lock);
+        }
+        if (st->queueCount == 0) {
+            break;
+        }
+        FsckDir dir = st->queue[--st->queueCount];
+        st->busy++;
+        pthread_mutex_unlock(&st->lock);
+
+        fsckScanDirectory(st, &dir, buffer, &syscalls, &bytesRead, &files);
+        directories++;
+
+        pthread_mutex_lock(&st->lock);
+        st->busy--;
+        if (st->busy == 0 && st->queueCount == 0) {
+            pthread_cond_broadcast(&st->wake);
+        }
+    }
+    st->syscalls += syscalls;
+    st->bytesRead += bytesRead;
+    st->files += files;
+    st->directories += directories;
+    pthread_cond_broadcast(&st->wake);
+    pthread_mutex_unlock(&st->lock);
+
+    free(buffer);
+    return NULL;
+}
+
+//clusters in use that nothing reaches are lost, the ones nothing points to start a lost chain
+static void* fsckLostWorker(void* arg) {
+    FsckWorker* w = arg;
+    FsckState* st = w->st;
+    unsigned long long lost = 0, chains = 0;
+    for (unsigned int cluster = w->first < 2 ? 2 : w->first; cluster < w->last; cluster++) {
+        uint32_t next = st->fat[cluster] & FAT_ENTRY_MASK;
+        if (next == 0 || next == FAT_BAD_CLUSTER || fsckTest(st->reachable, cluster)) {
+            continue;
+        }
+        lost++;
+        if (!fsckTest(st->referenced, cluster)) {
+            chains++;
+        }
+    }
+    pthread_mutex_lock(&st->lock);
+    st->lostClusters += lost;
+    st->lostChains += chains;
+    pthread_mutex_unlock(&st->lock);
+    return NULL;
+}
+
+//run one phase on every thread, each given an equal slice of the cluster range
+static bool fsckRunPhase(FsckState* st, FsckWorker* workers, pthread_t* tids, void* (*phase)(void*)) {
+    unsigned int slice = (st->bsi->maxCluster + st->threads - 1) / st->threads;
+    unsigned int started = 0;
+    for (unsigned int t = 0; t < st->threads; t++) {
+        workers[t].st = st;
+        workers[t].first = t * slice < st->bsi->maxCluster ? t * slice : st->bsi->maxCluster;
+        workers[t].last = workers[t].first + slice < st->bsi->maxCluster ? workers[t].first + slice : st->bsi->maxCluster;
+        if (pthread_create(&tids[t], NULL, phase, &workers[t]) != 0) {
+            //whatever is left runs on this thread
+            workers[t].last = st->bsi->maxCluster;
+            phase(&workers[t]);
+            break;
+        }
+        started++;
+    }
+    for (unsigned int t = 0; t < started; t++) {
+        pthread_join(tids[t], NULL);
+    }
+    return !st->failed;
+}
+
+//function to handle fsck: validate chains, cross links, lost clusters, sizes and FAT mirrors
+void checkImage(int fd, unsigned int threads, BootSectorInfo* bsi) {
+    //the image has to reflect everything written so far
+    flushAllOpenFiles(fd, bsi);
+    writeBackMetadata(fd, bsi);
+
+    if (threads == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = online > 0 ? (unsigned int)online : 1;
+    }
+    if (threads > FSCK_MAX_THREADS) {
+        threads = FSCK_MAX_THREADS;
+    }
+
+    FsckState st;
+    memset(&st, 0, sizeof(st));
+    st.fd = fd;
+    st.bsi = bsi;
+    st.threads = threads;
+    st.out = output();
+    size_t words = (bsi->maxCluster + 63) / 64;
+    st.fat = malloc((size_t)bsi->maxCluster * 4);
+    st.referenced = calloc(words, sizeof(uint64_t));
+    st.shared = calloc(words, sizeof(uint64_t));
+    st.reachable = calloc(words, sizeof(uint64_t));
+    FsckWorker* workers = calloc(threads, sizeof(FsckWorker));
+    pthread_t* tids = calloc(threads, sizeof(pthread_t));
+    pthread_mutex_init(&st.lock, NULL);
+    pthread_cond_init(&st.wake, NULL);
+
+    bool ok = st.fat && st.referenced && st.shared && st.reachable && workers && tids;
+    if (!ok) {
+        reply("Error: Not enough memory to check the image\n");
+    }
+
+    ok = ok && fsckRunPhase(&st, workers, tids, fsckFatWorker);
+
+    //clusters with two FAT entries pointing at them are cross-linked wherever they sit
+    for (size_t i = 0; ok && i < words; i++) {
+        for (uint64_t bits = st.shared[i]; bits; bits &= bits - 1) {
+            fsckProblem(&st, &st.crossLinked, "Cluster %u is the successor of more than one cluster\n",
+                        (unsigned int)(i * 64 + __builtin_ctzll(bits)));
+        }
+    }
+
+    if (ok) {
+        fsckQueueDirectory(&st, bsi->rootCluster, "/");
+        unsigned int started = 0;
+        for (unsigned int t = 0; t < threads; t++) {
+            workers[t].st = &st;
+            if (pthread_create(&tids[t], NULL, fsckTreeWorker, &workers[t]) != 0) {
+                break;
+            }
+            started++;
+        }
+        if (started == 0) {
+            fsckTreeWorker(&workers[0]);
+        }
+        for (unsigned int t = 0; t < started; t++) {
+            pthread_join(tids[t], NULL);
+        }
+        ok = !st.failed;
+    }
+
+    ok = ok && fsckRunPhase(&st, workers, tids, fsckLostWorker);
+
+    activeStats->syscalls += st.syscalls;
+    activeStats->bytesRead += st.bytesRead;
+
+    if (!ok) {
+        reply("Error: fsck could not finish\n");
+    } else {
+        unsigned long long problems = st.mirrorMismatches + st.badPointers + st.crossLinked + st.sizeMismatches + st.lostClusters;
+        reply("Checked %llu files and %llu directories, %llu clusters in use, %u threads\n",
+               st.files, st.directories, st.usedClusters, threads);
+        reply("FAT mirror mismatches: %llu\n", st.mirrorMismatches);
+        reply("Bad cluster pointers: %llu\n", st.badPointers);
+        reply("Cross-linked clusters: %llu\n", st.crossLinked);
+        reply("Size mismatches: %llu\n", st.sizeMismatches);
+        reply("Lost clusters: %llu in %llu chains\n", st.lostClusters, st.lostChains);
+        reply(problems ? "Image has problems\n" : "Image is clean\n");
+    }
+
+    pthread_cond_destroy(&st.wake);
+    pthread_mutex_destroy(&st.lock);
+    free(st.queue);
+    free(tids);
+    free(workers);
+    free(st.reachable);
+    free(st.shared);
+    free(st.referenced);
+    free(st.fat);
+}
+
+//directory found while scanning a tree for fragmentation
+typedef struct {
+    unsigned int cluster;
+    char path[512];
+} FragDir;
+
+//file found while scanning, with the shape of its cluster chain
+typedef struct {
+    unsigned int dir;           //index of the directory in the scan's list, for the path
+    unsigned int dirCluster;
+    unsigned int entryIndex;
+    unsigned int head;
+    unsigned int clusters;
+    unsigned int extents;       //runs of physically contiguous clusters
+    char name[13];
+} FragFile;
+
+typedef struct {
+    FragDir* dirs;
+    unsigned int dirCount;
+    unsigned int dirCapacity;
+    FragFile* files;
+    unsigned int fileCount;
+    unsigned int fileCapacity;
+    unsigned int fragmentedDirs;
+    unsigned long long dirExtents;
+} FragScan;
+
+//count the clusters of a chain and how many contiguous runs they form
+static unsigned int chainExtents(int fd, unsigned int head, unsigned int* clusters, BootSectorInfo* bsi) {
+    unsigned int extents = 0, count = 0;
+    unsigned int cluster = head, previous = 0;
+    while (cluster >= 2 && cluster < bsi->maxCluster && count <= bsi->totalClusters) {
+        if (cluster != previous + 1) extents++;
+        count++;
+        previous = cluster;
+        cluster = getNextCluster(fd, cluster, bsi);
+    }
+    *clusters = count;
+    return extents;
+}
+
+//parentPath/name without doubling the root's slash
+static void fragJoin(char* out, size_t size, const char* parentPath, const char* name) {
+    size_t len = strlen(parentPath);
+    snprintf(out, size, "%s%s%s", parentPath, len && parentPath[len - 1] != '/' && *name ? "/" : "", name);
+}
+
+static bool fragAddDir(FragScan* scan, unsigned int cluster, const char* parentPath, const char* name) {
+    //parentPath may point into the list that is about to grow
+    char path[512];
+    fragJoin(path, sizeof(path), parentPath, name);
+    if (scan->dirCount == scan->dirCapacity) {
+        unsigned int capacity = scan->dirCapacity ? scan->dirCapacity * 2 : 64;
+        FragDir* grown = realloc(scan->dirs, capacity * sizeof(FragDir));
+        if (!grown) {
+            reply("Error: Not enough memory to scan the tree\n");
+            return false;
+        }
+        scan->dirs = grown;
+        scan->dirCapacity = capacity;
+    }
+    FragDir* dir = &scan->dirs[scan->dirCount++];
+    dir->cluster = cluster;
+    memcpy(dir->path, path, sizeof(path));
+    return true;
+}
+
+static bool fragAddFile(FragScan* scan, int fd, unsigned int dir, DirCache* dc, unsigned int index, BootSectorInfo* bsi) {
+    if (scan->fileCount == scan->fileCapacity) {
+        unsigned int capacity = scan->fileCapacity ? scan->fileCapacity * 2 : 256;
+        FragFile* grown = realloc(scan->files, capacity * sizeof(FragFile));
+        if (!grown) {
+            reply("Error: Not enough memory to scan the tree\n");
+            return false;
+        }
+        scan->files = grown;
+        scan->fileCapacity = capacity;
+    }
+    FragFile* file = &scan->files[scan->fileCount++];
+    file->dir = dir;
+    file->dirCluster = dc->cluster;
+    file->entryIndex = index;
+    file->head = entryCluster(&dc->entries[index]);
+    formatEntryName(&dc->entries[index], file->name);
+    file->extents = chainExtents(fd, file->head, &file->clusters, bsi);
+    return true;
+}
+
+//collect every file under path (the whole image when path is NULL), breadth first
+//a path naming a file scans just that file
+static bool fragCollect(int fd, const char* path, DirectoryContext* context, FragScan* scan, BootSectorInfo* bsi) {
+    DirectoryContext target = {bsi->rootCluster, "/", "", {0}, 0};
+    if (path) {
+        //a file is looked up in its parent, anything else has to be a directory
+        const char* slash = strrchr(path, '/');
+        const char* name = slash ? slash + 1 : path;
+        char dirPath[512], packed[11];
+        snprintf(dirPath, sizeof(dirPath), "%.*s", slash ? (slash == path ? 1 : (int)(slash - path)) : 1, slash ? path : ".");
+        DirectoryContext parent;
+        if (!resolveDirectory(fd, dirPath, context, &parent, bsi)) {
+            return false;
+        }
+        if (*name && strcmp(name, ".") && strcmp(name, "..") && packName(name, packed)) {
+            DirCache* dir = loadDirectory(fd, parent.currentCluster, bsi);
+            int index = dir ? findEntry(dir, packed) : -1;
+            if (index < 0) {
+                reply("Error: File or directory not found.\n");
+                return false;
+            }
+            if (!(dir->entries[index].attr & ATTR_DIRECTORY)) {
+                return fragAddDir(scan, parent.currentCluster, parent.path, "") && fragAddFile(scan, fd, 0, dir, index, bsi);
+            }
+        }
+        if (!resolveDirectory(fd, path, context, &target, bsi)) {
+            return false;
+        }
+    }
+
+    if (!fragAddDir(scan, target.currentCluster, target.path, "")) {
+        return false;
+    }
+    for (unsigned int d = 0; d < scan->dirCount; d++) {
+        unsigned int clusters;
+        unsigned int extents = chainExtents(fd, scan->dirs[d].cluster, &clusters, bsi);
+        scan->dirExtents += extents;
+        scan->fragmentedDirs += extents > 1;
+
+        DirCache* dc = loadDirectory(fd, scan->dirs[d].cluster, bsi);
+        if (!dc) {
+            return false;
+        }
+        for (unsigned int i = 0; i < dc->endIndex; i++) {
+            DirEntry* entry = &dc->entries[i];
+            if ((unsigned char)entry->name[0] == 0xE5 || entry->name[0] == '.' || entry->attr == 0x0F || (entry->attr & 0x08)) {
+                continue;
+            }
+            unsigned int head = entryCluster(entry);
+            if (!(entry->attr & ATTR_DIRECTORY)) {
+                if (!fragAddFile(scan, fd, d, dc, i, bsi)) {
+                    return false;
                 }
+                continue;
+            }
+            if (head < 2 || head >= bsi->maxCluster || head == bsi->rootCluster || scan->dirCount > bsi->totalClusters) {
+                continue;
+            }
+            char name[13];
+            formatEntryName(entry, name);
+            if (!fragAddDir(scan, head, scan->dirs[d].path, name)) {
+                return false;
+            }
+            //adding a directory may have moved the list, and nothing else loads directories here
+            dc = loadDirectory(fd, scan->dirs[d].cluster, bsi);
+            if (!dc) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static void fragFree(FragScan* scan) {
+    free(scan->dirs);
+    free(scan->files);
+}
+
+static int compareFragFiles(const void* a, const void* b) {
+    const FragFile* x = a;
+    const FragFile* y = b;
+    if (x->extents != y->extents) return x->extents < y->extents ? 1 : -1;
+    return x->clusters < y->clusters ? 1 : x->clusters > y->clusters ? -1 : 0;
+}
+
+//function to handle frag: extents per file and a histogram of free runs
+void showFragmentation(int fd, const char* path, DirectoryContext* context, BootSectorInfo* bsi) {
+    FragScan scan;
+    memset(&scan, 0, sizeof(scan));
+    if (!fragCollect(fd, path, context, &scan, bsi)) {
+        fragFree(&scan);
+        return;
+    }
+
+    unsigned int fragmented = 0;
+    unsigned long long extents = 0, clusters = 0;
+    for (unsigned int i = 0; i < scan.fileCount; i++) {
+        fragmented += scan.files[i].extents > 1;
+        extents += scan.files[i].extents;
+        clusters += scan.files[i].clusters;
+    }
+    if (scan.fileCount) {
+        qsort(scan.files, scan.fileCount, sizeof(FragFile), compareFragFiles);
+    }
+    reply("Files: %u, fragmented: %u, %llu clusters in %llu extents\n", scan.fileCount, fragmented, clusters, extents);
+    if (scan.dirExtents) {
+        //nothing to say about directories when a single file was scanned
+        reply("Directories: %u, fragmented: %u, %llu extents\n", scan.dirCount, scan.fragmentedDirs, scan.dirExtents);
+    }
+    if (fragmented) {
+        reply("%8s %9s  %s\n", "EXTENTS", "CLUSTERS", "PATH");
+        for (unsigned int i = 0; i < fragmented && i < FRAG_MAX_REPORTS; i++) {
+            FragFile* file = &scan.files[i];
+            char filePath[528];
+            fragJoin(filePath, sizeof(filePath), scan.dirs[file->dir].path, file->name);
+            reply("%8u %9u  %s\n", file->extents, file->clusters, filePath);
+        }
+        if (fragmented > FRAG_MAX_REPORTS) {
+            reply("... %u more fragmented files\n", fragmented - FRAG_MAX_REPORTS);
+        }
+    }
+
+    //free runs by power-of-two length, whole words of the bitmap at a time
+    unsigned long long runs[32] = {0}, runClusters[32] = {0};
+    unsigned int run = 0, largest = 0, totalRuns = 0;
+    for (unsigned int cluster = 2; cluster <= bsi->maxCluster; cluster++) {
+        bool used = cluster == bsi->maxCluster || clusterUsed(cluster);
+        if (!used && cluster % 64 == 0 && cluster + 64 <= bsi->maxCluster && allocator.bitmap[cluster / 64] == 0) {
+            run += 64;
+            cluster += 63;
+            continue;
+        }
+        if (!used) {
+            run++;
+            continue;
+        }
+        if (run) {
+            int bucket = 31 - __builtin_clz(run);
+            runs[bucket]++;
+            runClusters[bucket] += run;
+            totalRuns++;
+            if (run > largest) largest = run;
+            run = 0;
+        }
+        if (cluster % 64 == 0 && cluster + 64 <= bsi->maxCluster && allocator.bitmap[cluster / 64] == ~(uint64_t)0) {
+            cluster += 63;
+        }
+    }
+    reply("Free space: %u clusters in %u runs, largest run %u clusters\n", allocator.freeCount, totalRuns, largest);
+    if (totalRuns) {
+        reply("%-17s %9s %12s\n", "RUN LENGTH", "RUNS", "CLUSTERS");
+        for (int b = 0; b < 32; b++) {
+            if (!runs[b]) {
+                continue;
+            }
+            char label[32];
+            if (b == 0) snprintf(label, sizeof(label), "1");
+            else snprintf(label, sizeof(label), "%u-%u", 1u << b, (unsigned int)((2ull << b) - 1));
+            reply("%-17s %9llu %12llu\n", label, runs[b], runClusters[b]);
+        }
+    }
+    fragFree(&scan);
+}
+
+//copy a file's whole chain into the contiguous run starting at first
+//reads follow the old extents, writes go out as one long sequential run per buffer
+static bool defragCopy(int fd, const FragFile* file, unsigned int first, unsigned char* buffer, size_t bufferSize, BootSectorInfo* bsi) {
+    unsigned int clusterSize = bsi->bytesPerSector * bsi->sectorsPerCluster;
+    OpenFile source;
+    memset(&source, 0, sizeof(source));
+    snprintf(source.fileName, sizeof(source.fileName), "%s", file->name);
+    source.cluster = file->head;
+
+    bool ok = true;
+    unsigned long total = (unsigned long)file->clusters * clusterSize;
+    for (unsigned long done = 0; ok && done < total; done += bufferSize) {
+        size_t chunk = total - done < bufferSize ? total - done : bufferSize;
+        IoBatch batch;
+        ioBatchInit(&batch, fd, true, &activeStats->syscalls);
+        ok = readFileData(fd, &source, done, buffer, chunk, bsi) == (long)chunk &&
+             ioBatchAdd(&batch, buffer, chunk, clusterOffset(first, bsi) + (off_t)done) && ioBatchSubmit(&batch);
+        if (ok) activeStats->bytesWritten += chunk;
+    }
+    invalidateExtents(&source);
+    return ok;
+}
+
+//function to handle defrag: move every fragmented file under path into one contiguous run
+//per file the new chain reaches the image before the entry that points to it, and the old
+//chain is freed only after that, so a crash leaves either the old or the new file intact
+void defragment(int fd, const char* path, DirectoryContext* context, BootSectorInfo* bsi) {
+    //the copies read the image, so buffered writes have to be there first
+    flushAllOpenFiles(fd, bsi);
+
+    FragScan scan;
+    memset(&scan, 0, sizeof(scan));
+    unsigned int clusterSize = bsi->bytesPerSector * bsi->sectorsPerCluster;
+    size_t bufferSize = BULK_IO_SIZE / clusterSize ? BULK_IO_SIZE / clusterSize * clusterSize : clusterSize;
+    unsigned char* buffer = malloc(bufferSize);
+    if (!buffer) {
+        reply("Error: Not enough memory to defragment\n");
+        return;
+    }
+    if (!fragCollect(fd, path, context, &scan, bsi)) {
+        free(buffer);
+        fragFree(&scan);
+        return;
+    }
+
+    unsigned int moved = 0, noRoom = 0, busy = 0;
+    unsigned long long clustersMoved = 0, extentsBefore = 0;
+    for (unsigned int i = 0; i < scan.fileCount; i++) {
+        FragFile* file = &scan.files[i];
+        if (file->extents < 2) {
+            continue;
+        }
+        //another session's handle would keep using the old chain
+        const OpenFileTable* owner = openOwner(file->dirCluster, file->entryIndex);
+        if (owner && owner != &openTable) {
+            busy++;
+            continue;
+        }
+
+        //allocateClusters takes the first run it finds, check there is one so the chain is not scattered again
+        if (!findFreeRun(allocator.nextFree, file->clusters, bsi) && !findFreeRun(2, file->clusters, bsi)) {
+            noRoom++;
+            continue;
+        }
+        unsigned int first = allocateClusters(fd, file->clusters, 0, bsi);
+        if (!first) {
+            noRoom++;
+            continue;
+        }
+        for (unsigned int c = 0; c < file->clusters; c++) {
+            clusterCacheDrop(first + c);
+        }
+
+        DirCache* dir = NULL;
+        if (!defragCopy(fd, file, first, buffer, bufferSize, bsi) || !(dir = loadDirectory(fd, file->dirCluster, bsi)) ||
+            entryCluster(&dir->entries[file->entryIndex]) != file->head) {
+            reply("Error: Could not move %s\n", file->name);
+            releaseChain(fd, first, bsi);
+            continue;
+        }
+
+        //FAT first, then the entry, then the old chain can go
+        DirEntry original = dir->entries[file->entryIndex];
+        DirEntry entry = original;
+        entry.firstClusterHigh = first >> 16;
+        entry.firstClusterLow = first & 0xFFFF;
+        bool updated = false;
+        if (!fatFlush(fd, bsi) || !(updated = updateEntry(fd, dir, file->entryIndex, &entry, bsi)) || !writeBackMetadata(fd, bsi)) {
+            //point the entry back at the old chain before the new one is freed
+            reply("Error writing updated directory\n");
+            if (updated && (dir = loadDirectory(fd, file->dirCluster, bsi))) {
+                updateEntry(fd, dir, file->entryIndex, &original, bsi);
+            }
+            releaseChain(fd, first, bsi);
+            break;
+        }
+        releaseChain(fd, file->head, bsi);
+
+        //an open copy of the file has to find its data in the new place
+        OpenFile* open = fileByHandle(handleByKey(file->dirCluster, file->entryIndex));
+        if (open) {
+            readAheadDrop(open);
+            invalidateExtents(open);
+            open->cluster = first;
+        }
+        moved++;
+        clustersMoved += file->clusters;
+        extentsBefore += file->extents;
+    }
+    metadataFlush(fd, bsi);
+
+    status("Defragmented %u files, %llu clusters moved, %llu extents became %u\n", moved, clustersMoved, extentsBefore, moved);
+    if (noRoom) {
+        reply("%u fragmented files were left in place, no free run was long enough\n", noRoom);
+    }
+    if (busy) {
+        reply("%u fragmented files were left in place, they are open in other sessions\n", busy);
+    }
+    free(buffer);
+    fragFree(&scan);
+}
+
+//one unit of export work: a directory to list or a file to copy
+typedef struct {
+    unsigned int cluster;
+    unsigned int size;
+    bool isDirectory;
+    char hostPath[BULK_PATH_MAX];
+} ExportTask;
+
+//per-worker deque: the owner pushes and pops at the tail, idle workers steal from the head
+typedef struct {
+    pthread_mutex_t lock;
+    ExportTask* tasks;
+    unsigned int head;
+    unsigned int tail;
+    unsigned int capacity;
+} ExportQueue;
+
+typedef struct {
+    int fd;
+    BootSectorInfo* bsi;
+    unsigned int threads;
+    ExportQueue* queues;
+    unsigned int pending;       //tasks queued or running, workers exit when it reaches 0
+    pthread_mutex_t idleLock;   //idle workers sleep on wake until a task is pushed or pending reaches 0
+    pthread_cond_t wake;
+    pthread_mutex_t lock;       //guards the totals and error output
+    unsigned long long files;
+    unsigned long long directories;
+    unsigned long long bytes;
+    unsigned long long syscalls;
+    unsigned long long steals;
+    unsigned int errors;
+    FILE* out;
+} ExportState;
+
+typedef struct {
+    ExportState* st;
+    unsigned int id;
+} ExportWorker;
+
+static void exportError(ExportState* st, const char* format, ...) {
+    pthread_mutex_lock(&st->lock);
+    if (st->errors++ < FSCK_MAX_REPORTS) {
+        va_list args;
+        va_start(args, format);
+        vfprintf(st->out, format, args);
+        va_end(args);
+    }
+    pthread_mutex_unlock(&st->lock);
+}
+
+static bool exportPush(ExportState* st, unsigned int worker, const ExportTask* task) {
+    ExportQueue* q = &st->queues[worker];
+    pthread_mutex_lock(&q->lock);
+    if (q->tail == q->capacity) {
+        //slide live tasks down before growing
+        if (q->head > 0) {
+            memmove(q->tasks, q->tasks + q->head, (q->tail - q->head) * sizeof(ExportTask));
+            q->tail -= q->head;
+            q->head = 0;
+        }
+        if (q->tail == q->capacity) {
+            unsigned int capacity = q->capacity ? q->capacity * 2 : 64;
+            ExportTask* grown = realloc(q->tasks, capacity * sizeof(ExportTask));
+            if (!grown) {
+                pthread_mutex_unlock(&q->lock);
+                exportError(st, "Error: Out of memory queueing %s\n", task->hostPath);
+                return false;
+            }
+            q->tasks = grown;
+            q->capacity = capacity;
+        }
+    }
+    q->tasks[q->tail++] = *task;
+    __atomic_add_fetch(&st->pending, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&q->lock);
+
+    pthread_mutex_lock(&st->idleLock);
+    pthread_cond_signal(&st->wake);
+    pthread_mutex_unlock(&st->idleLock);
+    return true;
+}
+
+//take from our own tail first (depth first, stays cache warm), otherwise steal the oldest task of another worker
+static bool exportTake(ExportState* st, unsigned int worker, ExportTask* out) {
+    for (unsigned int i = 0; i < st->threads; i++) {
+        unsigned int victim = (worker + i) % st->threads;
+        ExportQueue* q = &st->queues[victim];
+        pthread_mutex_lock(&q->lock);
+        if (q->head < q->tail) {
+            *out = i == 0 ? q->tasks[--q->tail] : q->tasks[q->head++];
+            if (q->head == q->tail) {
+                q->head = q->tail = 0;
+            }
+            pthread_mutex_unlock(&q->lock);
+            if (i != 0) {
+                __atomic_add_fetch(&st->steals, 1, __ATOMIC_RELAXED);
+            }
+            return true;
+        }
+        pthread_mutex_unlock(&q->lock);
+    }
+    return false;
+}
+
+//append len bytes to a host file being exported
+static bool exportWrite(ExportState* st, int out, const char* hostPath, const unsigned char* src, unsigned long len,
+                        unsigned long long* syscalls) {
+    for (unsigned long done = 0; done < len; ) {
+        (*syscalls)++;
+        ssize_t n = write(out, src + done, len - done);
+        if (n < 0) {
+            exportError(st, "Error: Cannot write %s: %s\n", hostPath, strerror(errno));
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+//stream one file's chain to a host file a buffer at a time
+//the reads of every contiguous run that fits in the buffer are submitted as one batch
+//the FAT is fully resident after mount and nothing modifies it while the workers run
+static bool exportFile(ExportState* st, const ExportTask* task, unsigned char* buffer, unsigned long long* syscalls) {
+    BootSectorInfo* bsi = st->bsi;
+    unsigned int clusterSize = bsi->bytesPerSector * bsi->sectorsPerCluster;
+    unsigned long limit = BULK_IO_SIZE > clusterSize ? BULK_IO_SIZE : clusterSize;
+    int out = open(task->hostPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        exportError(st, "Error: Cannot create %s: %s\n", task->hostPath, strerror(errno));
+        return false;
+    }
+
+    unsigned long remaining = task->size;
+    unsigned int cluster = task->cluster;
+    bool ok = true;
+    IoBatch batch;
+    while (remaining > 0 && ok) {
+        ioBatchInit(&batch, st->fd, false, syscalls);
+        unsigned long window = 0;
+        while (remaining > window && window + clusterSize <= limit) {
+            if (cluster < 2 || cluster >= bsi->maxCluster) {
+                exportError(st, "Error: Broken cluster chain in %s\n", task->hostPath);
+                ok = false;
+                break;
+            }
+
+            //extend the run while the chain stays contiguous
+            unsigned int runLength = 1;
+            unsigned long runBytes = clusterSize;
+            while (window + runBytes < remaining && window + runBytes + clusterSize <= limit &&
+                   (fatCache.entries[cluster + runLength - 1] & FAT_ENTRY_MASK) == cluster + runLength) {
+                runLength++;
+                runBytes += clusterSize;
+            }
+            unsigned long len = runBytes < remaining - window ? runBytes : remaining - window;
+
+            //a mapped image is written out straight from the mapping
+            off_t offset = clusterOffset(cluster, bsi);
+            const unsigned char* src = imagePtr(offset, len);
+            if (src) {
+                ok = exportWrite(st, out, task->hostPath, src, len, syscalls);
+                remaining -= len;
+            } else if (ioBatchAdd(&batch, buffer + window, len, offset)) {
+                window += len;
+            } else {
+                exportError(st, "Error: Cannot read %s from the image\n", task->hostPath);
+                ok = false;
+            }
+            cluster = fatCache.entries[cluster + runLength - 1] & FAT_ENTRY_MASK;
+            if (!ok || src) {
+                break;
+            }
+        }
+
+        if (ok && window > 0) {
+            if (!ioBatchSubmit(&batch)) {
+                exportError(st, "Error: Cannot read %s from the image\n", task->hostPath);
+                ok = false;
+            } else {
+                ok = exportWrite(st, out, task->hostPath, buffer, window, syscalls);
+                remaining -= window;
+            }
+        }
+    }
+
+    if (close(out) < 0) {
+        exportError(st, "Error: Cannot close %s: %s\n", task->hostPath, strerror(errno));
+        ok = false;
+    }
+    return ok;
+}
+
+//create the host directory's children and queue every entry as its own task
+static void exportDirectory(ExportState* st, unsigned int worker, const ExportTask* task, unsigned char* buffer,
+                            unsigned long long* syscalls) {
+    BootSectorInfo* bsi = st->bsi;
+    unsigned int clusterSize = bsi->bytesPerSector * bsi->sectorsPerCluster;
+    unsigned int cluster = task->cluster;
+    unsigned int hops = 0;
+
+    while (cluster >= 2 && cluster < bsi->maxCluster && hops++ < bsi->totalClusters) {
+        if (!imageReadShared(st->fd, buffer, clusterSize, clusterOffset(cluster, bsi), syscalls)) {
+            exportError(st, "Error: Cannot read directory for %s\n", task->hostPath);
+            return;
+        }
+        for (unsigned int i = 0; i < clusterSize / DIR_ENTRY_SIZE; i++) {
+            DirEntry* entry = (DirEntry*)(buffer + i * DIR_ENTRY_SIZE);
+            if (entry->name[0] == 0) {
+                return;
+            }
+            if ((unsigned char)entry->name[0] == 0xE5 || entry->name[0] == '.' ||
+                entry->attr == 0x0F || (entry->attr & 0x08)) {
+                continue;
             }
-            free(dirBuffer);
-            //mark the directory as deleted
-            if (isEmpty) {
-                entries[i].name[0] = 0xE5; 
+
+            ExportTask child;
+            char name[13];
+            formatEntryName(entry, name);
+            if ((size_t)snprintf(child.hostPath, sizeof(child.hostPath), "%s/%s", task->hostPath, name) >= sizeof(child.hostPath)) {
+                exportError(st, "Error: Host path too long under %s\n", task->hostPath);
+                continue;
+            }
+            child.cluster = entryCluster(entry);
+            child.size = entry->fileSize;
+            child.isDirectory = entry->attr & ATTR_DIRECTORY;
+            if (child.isDirectory && mkdir(child.hostPath, 0755) < 0 && errno != EEXIST) {
+                exportError(st, "Error: Cannot create %s: %s\n", child.hostPath, strerror(errno));
+                continue;
+            }
+            exportPush(st, worker, &child);
+        }
+        cluster = fatCache.entries[cluster] & FAT_ENTRY_MASK;
+    }
+}
+
+static void* exportWorker(void* arg) {
+    ExportWorker* w = arg;
+    ExportState* st = w->st;
+    unsigned long long syscalls = 0, files = 0, directories = 0, bytes = 0;
+    unsigned char* buffer = malloc(BULK_IO_SIZE > st->bsi->bytesPerSector * st->bsi->sectorsPerCluster ?
+                                   BULK_IO_SIZE : st->bsi->bytesPerSector * st->bsi->sectorsPerCluster);
+
+    for (;;) {
+        ExportTask task;
+        if (!exportTake(st, w->id, &task)) {
+            //retrying under idleLock means a push cannot slip in between the last look and the wait
+            bool taken = false;
+            pthread_mutex_lock(&st->idleLock);
+            while (__atomic_load_n(&st->pending, __ATOMIC_ACQUIRE) > 0 && !(taken = exportTake(st, w->id, &task))) {
+                pthread_cond_wait(&st->wake, &st->idleLock);
+            }
+            pthread_mutex_unlock(&st->idleLock);
+            if (!taken) {
+                break;
+            }
+        }
+        if (!buffer) {
+            exportError(st, "Error: Out of memory exporting %s\n", task.hostPath);
+        } else if (task.isDirectory) {
+            exportDirectory(st, w->id, &task, buffer, &syscalls);
+            directories++;
+        } else if (exportFile(st, &task, buffer, &syscalls)) {
+            files++;
+            bytes += task.size;
+        }
+        //children were queued before this drops, so pending cannot hit 0 early
+        if (__atomic_sub_fetch(&st->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+            pthread_mutex_lock(&st->idleLock);
+            pthread_cond_broadcast(&st->wake);
+            pthread_mutex_unlock(&st->idleLock);
+        }
+    }
+
+    pthread_mutex_lock(&st->lock);
+    st->syscalls += syscalls;
+    st->files += files;
+    st->directories += directories;
+    st->bytes += bytes;
+    pthread_mutex_unlock(&st->lock);
+    ioRingFree();
+    free(buffer);
+    return NULL;
+}
+
+//function to handle export: copy a directory tree out of the image to the host
+void exportTree(int fd, const char* dirName, const char* hostPath, unsigned int threads, DirectoryContext* context, BootSectorInfo* bsi) {
+    DirectoryContext source;
+    if (!resolveDirectory(fd, dirName, context, &source, bsi)) {
+        return;
+    }
+    if (mkdir(hostPath, 0755) < 0 && errno != EEXIST) {
+        reply("Error: Cannot create %s: %s\n", hostPath, strerror(errno));
+        return;
+    }
+
+    //workers read directories and file data straight from the image
+    flushAllOpenFiles(fd, bsi);
+    writeBackMetadata(fd, bsi);
+
+    if (threads == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = online > 0 ? (unsigned int)online : 1;
+    }
+    if (threads > FSCK_MAX_THREADS) {
+        threads = FSCK_MAX_THREADS;
+    }
+
+    ExportState st;
+    memset(&st, 0, sizeof(st));
+    st.fd = fd;
+    st.bsi = bsi;
+    st.threads = threads;
+    st.out = output();
+    st.queues = calloc(threads, sizeof(ExportQueue));
+    ExportWorker* workers = calloc(threads, sizeof(ExportWorker));
+    pthread_t* tids = calloc(threads, sizeof(pthread_t));
+    if (!st.queues || !workers || !tids) {
+        reply("Error: Not enough memory to export\n");
+        free(st.queues);
+        free(workers);
+        free(tids);
+        return;
+    }
+    pthread_mutex_init(&st.lock, NULL);
+    pthread_mutex_init(&st.idleLock, NULL);
+    pthread_cond_init(&st.wake, NULL);
+    for (unsigned int t = 0; t < threads; t++) {
+        pthread_mutex_init(&st.queues[t].lock, NULL);
+        workers[t].st = &st;
+        workers[t].id = t;
+    }
+
+    ExportTask root = {source.currentCluster, 0, true, ""};
+    snprintf(root.hostPath, sizeof(root.hostPath), "%s", hostPath);
+    unsigned long long startMicros = monotonicMicros();
+    exportPush(&st, 0, &root);
+
+    unsigned int started = 0;
+    for (unsigned int t = 0; t < threads; t++) {
+        if (pthread_create(&tids[t], NULL, exportWorker, &workers[t]) != 0) {
+            break;
+        }
+        started++;
+    }
+    if (started == 0) {
+        exportWorker(&workers[0]);
+    }
+    for (unsigned int t = 0; t < started; t++) {
+        pthread_join(tids[t], NULL);
+    }
+    double seconds = (monotonicMicros() - startMicros) / 1e6;
+
+    activeStats->syscalls += st.syscalls;
+    activeStats->bytesRead += st.bytes;
+    status("Exported %llu files (%llu bytes) and %llu directories to %s in %.2f s, %u threads, %llu steals, %s I/O\n",
+           st.files, st.bytes, st.directories, hostPath, seconds, threads, st.steals, ioEngineName());
+    if (st.errors) {
+        reply("Error: %u entries could not be exported\n", st.errors);
+    }
+
+    for (unsigned int t = 0; t < threads; t++) {
+        pthread_mutex_destroy(&st.queues[t].lock);
+        free(st.queues[t].tasks);
+    }
+    pthread_mutex_destroy(&st.lock);
+    pthread_mutex_destroy(&st.idleLock);
+    pthread_cond_destroy(&st.wake);
+    free(st.queues);
+    free(workers);
+    free(tids);
+}
+
+//one file or directory found on the host, in breadth first order so siblings are adjacent
+typedef struct {
+    char* hostPath;
+    char name[11];
+    bool isDirectory;
+    unsigned int size;
+    int parent;                 //node index, -1 for the destination directory
+    unsigned int firstChild;    //children occupy [firstChild, firstChild + childCount)
+    unsigned int childCount;
+    unsigned int firstCluster;  //planned chain, 0 for empty files
+    unsigned int clusterCount;
+    unsigned int chainStart;    //offset of this node's clusters in the planned cluster list
+} ImportNode;
+
+typedef struct {
+    int fd;
+    BootSectorInfo* bsi;
+    ImportNode* nodes;
+    unsigned int nodeCount;
+    unsigned int* clusters;     //every planned cluster, node chains back to back
+    unsigned int destCluster;
+    unsigned int next;          //next node to hand out
+    pthread_mutex_t lock;
+    unsigned long long bytes;
+    unsigned long long syscalls;
+    unsigned int errors;
+    FILE* out;
+} ImportState;
+
+static void importError(ImportState* st, const char* format, ...) {
+    pthread_mutex_lock(&st->lock);
+    if (st->errors++ < FSCK_MAX_REPORTS) {
+        va_list args;
+        va_start(args, format);
+        vfprintf(st->out, format, args);
+        va_end(args);
+    }
+    pthread_mutex_unlock(&st->lock);
+}
+
+static int compareImportNames(const void* a, const void* b) {
+    return memcmp(((const ImportNode*)a)->name, ((const ImportNode*)b)->name, 11);
+}
+
+static void freeImportNodes(ImportNode* nodes, unsigned int count) {
+    for (unsigned int i = 0; i < count; i++) {
+        free(nodes[i].hostPath);
+    }
+    free(nodes);
+}
+
+//add one host path as a node, returns false only when out of memory
+static bool addImportNode(ImportNode** nodes, unsigned int* count, unsigned int* capacity, const char* hostPath,
+                          const char* name, int parent) {
+    struct stat st;
+    if (lstat(hostPath, &st) < 0) {
+        reply("Error: Cannot stat %s: %s\n", hostPath, strerror(errno));
+        return true;
+    }
+    if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+        reply("Skipping %s: not a regular file or directory\n", hostPath);
+        return true;
+    }
+    if (S_ISREG(st.st_mode) && st.st_size > 0xFFFFFFFFLL) {
+        reply("Skipping %s: larger than 4 GB\n", hostPath);
+        return true;
+    }
+    char packed[11];
+    if (!packName(name, packed) || packed[0] == '.') {
+        reply("Skipping %s: not a valid 8.3 name\n", hostPath);
+        return true;
+    }
+
+    if (*count == *capacity) {
+        unsigned int grown = *capacity ? *capacity * 2 : 256;
+        ImportNode* larger = realloc(*nodes, grown * sizeof(ImportNode));
+        if (!larger) {
+            return false;
+        }
+        *nodes = larger;
+        *capacity = grown;
+    }
+    ImportNode* node = &(*nodes)[*count];
+    memset(node, 0, sizeof(ImportNode));
+    node->hostPath = strdup(hostPath);
+    if (!node->hostPath) {
+        return false;
+    }
+    memcpy(node->name, packed, 11);
+    node->isDirectory = S_ISDIR(st.st_mode);
+    node->size = node->isDirectory ? 0 : (unsigned int)st.st_size;
+    node->parent = parent;
+    (*count)++;
+    return true;
+}
+
+//add the children of one host directory, sorted by packed name with collisions dropped
+static bool scanImportDirectory(ImportNode** nodes, unsigned int* count, unsigned int* capacity, int parent, const char* hostPath) {
+    DIR* dir = opendir(hostPath);
+    if (!dir) {
+        reply("Error: Cannot open %s: %s\n", hostPath, strerror(errno));
+        return true;
+    }
+    unsigned int first = *count;
+    struct dirent* de;
+    char path[BULK_PATH_MAX];
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        if ((size_t)snprintf(path, sizeof(path), "%s/%s", hostPath, de->d_name) >= sizeof(path)) {
+            reply("Skipping %s/%s: path too long\n", hostPath, de->d_name);
+            continue;
+        }
+        if (!addImportNode(nodes, count, capacity, path, de->d_name, parent)) {
+            closedir(dir);
+            return false;
+        }
+    }
+    closedir(dir);
+
+    //two host names can pack to the same 8.3 name, e.g. differing only in case
+    qsort(*nodes + first, *count - first, sizeof(ImportNode), compareImportNames);
+    unsigned int kept = first;
+    for (unsigned int i = first; i < *count; i++) {
+        if (kept > first && memcmp((*nodes)[kept - 1].name, (*nodes)[i].name, 11) == 0) {
+            reply("Skipping %s: same 8.3 name as %s\n", (*nodes)[i].hostPath, (*nodes)[kept - 1].hostPath);
+            free((*nodes)[i].hostPath);
+            continue;
+        }
+        (*nodes)[kept++] = (*nodes)[i];
+    }
+    *count = kept;
+    if (parent >= 0) {
+        (*nodes)[parent].firstChild = first;
+        (*nodes)[parent].childCount = kept - first;
+    }
+    return true;
+}
+
+static void importEntry(DirEntry* entry, const char name[11], bool isDirectory, unsigned int cluster, unsigned int size) {
+    memset(entry, 0, sizeof(DirEntry));
+    memcpy(entry->name, name, 11);
+    entry->attr = isDirectory ? ATTR_DIRECTORY : 0x00;
+    entry->firstClusterHigh = (cluster >> 16) & 0xFFFF;
+    entry->firstClusterLow = cluster & 0xFFFF;
+    entry->fileSize = size;
+}
+
+//write buffer out to a node's planned clusters starting at cluster index first
+//each contiguous run is one request and all of them are submitted as one batch
+static bool importWriteRun(ImportState* st, ImportNode* node, unsigned int first, unsigned char* buffer, unsigned int clusters,
+                           unsigned long long* syscalls) {
+    unsigned int clusterSize = st->bsi->bytesPerSector * st->bsi->sectorsPerCluster;
+    const unsigned int* chain = st->clusters + node->chainStart + first;
+    IoBatch batch;
+    ioBatchInit(&batch, st->fd, true, syscalls);
+    unsigned int done = 0;
+    while (done < clusters) {
+        unsigned int run = 1;
+        while (done + run < clusters && chain[done + run] == chain[done] + run) {
+            run++;
+        }
+        if (!ioBatchAdd(&batch, buffer + (size_t)done * clusterSize, (size_t)run * clusterSize,
+                        clusterOffset(chain[done], st->bsi))) {
+            return false;
+        }
+        done += run;
+    }
+    return ioBatchSubmit(&batch);
+}
+
+//copy a host file into its planned clusters, zero filling the tail of the last cluster
+static void importFile(ImportState* st, ImportNode* node, unsigned char* buffer, unsigned long long* bytes, unsigned long long* syscalls) {
+    unsigned int clusterSize = st->bsi->bytesPerSector * st->bsi->sectorsPerCluster;
+    unsigned int perRun = BULK_IO_SIZE / clusterSize ? BULK_IO_SIZE / clusterSize : 1;
+    int in = open(node->hostPath, O_RDONLY);
+    if (in < 0) {
+        importError(st, "Error: Cannot open %s: %s\n", node->hostPath, strerror(errno));
+        return;
+    }
+
+    for (unsigned int done = 0; done < node->clusterCount; done += perRun) {
+        unsigned int clusters = node->clusterCount - done < perRun ? node->clusterCount - done : perRun;
+        size_t want = (size_t)clusters * clusterSize;
+        size_t got = 0;
+        while (got < want) {
+            ssize_t n = read(in, buffer + got, want - got);
+            if (n < 0) {
+                importError(st, "Error: Cannot read %s: %s\n", node->hostPath, strerror(errno));
+                break;
+            }
+            if (n == 0) break;
+            got += n;
+        }
+        memset(buffer + got, 0, want - got);
+        if (!importWriteRun(st, node, done, buffer, clusters, syscalls)) {
+            importError(st, "Error: Cannot write %s into the image\n", node->hostPath);
+            break;
+        }
+        *bytes += got;
+    }
+    close(in);
+}
+
+//build a new directory's clusters: '.', '..' and one entry per child
+static void importDirectory(ImportState* st, unsigned int index, unsigned char* buffer, unsigned long long* syscalls) {
+    ImportNode* node = &st->nodes[index];
+    unsigned int clusterSize = st->bsi->bytesPerSector * st->bsi->sectorsPerCluster;
+    memset(buffer, 0, (size_t)node->clusterCount * clusterSize);
+
+    DirEntry* entries = (DirEntry*)buffer;
+    unsigned int parentCluster = node->parent >= 0 ? st->nodes[node->parent].firstCluster : st->destCluster;
+    if (parentCluster == st->bsi->rootCluster) parentCluster = 0;
+    importEntry(&entries[0], ".          ", true, node->firstCluster, 0);
+    importEntry(&entries[1], "..         ", true, parentCluster, 0);
+    for (unsigned int i = 0; i < node->childCount; i++) {
+        ImportNode* child = &st->nodes[node->firstChild + i];
+        importEntry(&entries[2 + i], child->name, child->isDirectory, child->firstCluster, child->size);
+    }
+
+    if (!importWriteRun(st, node, 0, buffer, node->clusterCount, syscalls)) {
+        importError(st, "Error: Cannot write directory %s into the image\n", node->hostPath);
+    }
+}
+
+static void* importWorker(void* arg) {
+    ImportState* st = arg;
+    unsigned int clusterSize = st->bsi->bytesPerSector * st->bsi->sectorsPerCluster;
+    unsigned long long bytes = 0, syscalls = 0;
+
+    //a directory needs its whole chain in one buffer, files stream through BULK_IO_SIZE
+    size_t bufferSize = BULK_IO_SIZE > clusterSize ? BULK_IO_SIZE : clusterSize;
+    unsigned char* buffer = malloc(bufferSize);
+    if (!buffer) {
+        importError(st, "Error: Out of memory importing\n");
+        return NULL;
+    }
+
+    while (true) {
+        unsigned int index = __atomic_fetch_add(&st->next, 1, __ATOMIC_RELAXED);
+        if (index >= st->nodeCount) {
+            break;
+        }
+        ImportNode* node = &st->nodes[index];
+        if (!node->isDirectory) {
+            if (node->clusterCount) importFile(st, node, buffer, &bytes, &syscalls);
+            continue;
+        }
+        size_t needed = (size_t)node->clusterCount * clusterSize;
+        if (needed > bufferSize) {
+            unsigned char* larger = realloc(buffer, needed);
+            if (!larger) {
+                importError(st, "Error: Out of memory for directory %s\n", node->hostPath);
+                continue;
+            }
+            buffer = larger;
+            bufferSize = needed;
+        }
+        importDirectory(st, index, buffer, &syscalls);
+    }
+
+    pthread_mutex_lock(&st->lock);
+    st->bytes += bytes;
+    st->syscalls += syscalls;
+    pthread_mutex_unlock(&st->lock);
+    ioRingFree();
+    free(buffer);
+    return NULL;
+}
+
+//give back every cluster planned for an import that is not going to be committed
+static void importRelease(int fd, const unsigned int* clusters, unsigned long long count, BootSectorInfo* bsi) {
+    for (unsigned long long i = 0; i < count; i++) {
+        releaseCluster(fd, clusters[i], bsi);
+    }
+    metadataFlush(fd, bsi);
+}
+
+//function to handle import: copy a host file or directory tree into a directory of the image
+//allocation for the whole tree is planned first, data is written in parallel,
+//then the FAT and the destination's entries are committed in one pass
+void importTree(int fd, const char* hostPath, const char* dirName, unsigned int threads, DirectoryContext* context, BootSectorInfo* bsi) {
+    DirectoryContext dest;
+    if (!resolveDirectory(fd, dirName, context, &dest, bsi)) {
+        return;
+    }
+    struct stat hostStat;
+    if (stat(hostPath, &hostStat) < 0) {
+        reply("Error: Cannot stat %s: %s\n", hostPath, strerror(errno));
+        return;
+    }
+
+    unsigned long long startMicros = monotonicMicros();
+    ImportNode* nodes = NULL;
+    unsigned int nodeCount = 0, nodeCapacity = 0;
+    unsigned int topLevel;
+    bool ok;
+    if (S_ISDIR(hostStat.st_mode)) {
+        ok = scanImportDirectory(&nodes, &nodeCount, &nodeCapacity, -1, hostPath);
+        topLevel = nodeCount;
+        for (unsigned int i = 0; ok && i < nodeCount; i++) {
+            if (nodes[i].isDirectory) {
+                ok = scanImportDirectory(&nodes, &nodeCount, &nodeCapacity, i, nodes[i].hostPath);
             }
-            break;
         }
+    } else {
+        const char* base = strrchr(hostPath, '/');
+        ok = addImportNode(&nodes, &nodeCount, &nodeCapacity, hostPath, base ? base + 1 : hostPath, -1);
+        topLevel = nodeCount;
+    }
+    if (!ok) {
+        reply("Error: Out of memory scanning %s\n", hostPath);
+        freeImportNodes(nodes, nodeCount);
+        return;
     }
 
-    if (!found) {
-        printf("Error: Directory not found.\n");
-    } else if (!isEmpty) {
-        printf("Error: Directory is not empty or could not be read.\n");
-    } else {
-        //write back the updated buffer to the current directory's cluster
-        off_t offset = ((context->currentCluster - 2) * bsi->sectorsPerCluster + bsi->rootCluster) * bsi->bytesPerSector;
-        if (lseek(fd, offset, SEEK_SET) < 0) {
-            perror("Error seeking to update directory");
-        } else if (write(fd, buffer, bsi->bytesPerSector * bsi->sectorsPerCluster) < 0) {
-            perror("Error writing updated directory");
+    //refuse the import if any top-level name already exists in the destination
+    DirCache* destDir = loadDirectory(fd, dest.currentCluster, bsi);
+    if (!destDir) {
+        freeImportNodes(nodes, nodeCount);
+        return;
+    }
+    for (unsigned int i = 0; i < topLevel; i++) {
+        if (findEntry(destDir, nodes[i].name) >= 0) {
+            reply("Error: %s already exists in %s\n", nodes[i].hostPath, dest.path);
+            freeImportNodes(nodes, nodeCount);
+            return;
+        }
+    }
+
+    //plan: every node's cluster count, then one allocation covering all of them
+    unsigned int clusterSize = bsi->bytesPerSector * bsi->sectorsPerCluster;
+    unsigned long long totalClusters = 0;
+    for (unsigned int i = 0; i < nodeCount; i++) {
+        ImportNode* node = &nodes[i];
+        if (node->isDirectory) {
+            node->clusterCount = ((node->childCount + 2) * DIR_ENTRY_SIZE + clusterSize - 1) / clusterSize;
         } else {
-            printf("Directory removed successfully\n");
+            node->clusterCount = ((unsigned long long)node->size + clusterSize - 1) / clusterSize;
         }
+        node->chainStart = totalClusters;
+        totalClusters += node->clusterCount;
+    }
+    unsigned int perCluster = clusterSize / DIR_ENTRY_SIZE;
+    unsigned int destGrowth = topLevel > freeEntrySlots(destDir) ? (topLevel - freeEntrySlots(destDir) + perCluster - 1) / perCluster : 0;
+    if (totalClusters + destGrowth > allocator.freeCount) {
+        reply("Error: Import needs %llu clusters, only %u are free\n", totalClusters + destGrowth, allocator.freeCount);
+        freeImportNodes(nodes, nodeCount);
+        return;
     }
 
-    free(buffer);
-}
+    //the planned chain is linked in the in-memory FAT, only node boundaries need end markers
+    unsigned int* clusters = malloc((totalClusters ? totalClusters : 1) * sizeof(unsigned int));
+    unsigned int first = totalClusters && clusters ? allocateClusters(fd, totalClusters, 0, bsi) : 0;
+    if (!clusters || (totalClusters && !first)) {
+        reply("Error: Could not allocate clusters for the import\n");
+        free(clusters);
+        freeImportNodes(nodes, nodeCount);
+        return;
+    }
+    for (unsigned long long i = 0, c = first; i < totalClusters; i++, c = fatCache.entries[c] & FAT_ENTRY_MASK) {
+        clusters[i] = c;
+        clusterCacheDrop(c);
+    }
+    for (unsigned int i = 0; i < nodeCount; i++) {
+        ImportNode* node = &nodes[i];
+        if (node->clusterCount) {
+            node->firstCluster = clusters[node->chainStart];
+            fatSet(fd, clusters[node->chainStart + node->clusterCount - 1], FAT_ENTRY_MASK, bsi);
+        }
+    }
 
-void initializeOpenFiles() {
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        openFiles[i].isOpen = false;
+    //grow the destination before any data is written so a full image fails early
+    if (destGrowth && !(destDir = growDirectory(fd, destDir, destGrowth, bsi))) {
+        importRelease(fd, clusters, totalClusters, bsi);
+        free(clusters);
+        freeImportNodes(nodes, nodeCount);
+        return;
     }
-}
 
-//function to handle opening a file
-void openFile(int fd, const char* fileName, const char* mode, DirectoryContext* context, BootSectorInfo* bsi) {
-    //check if file is already open
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (openFiles[i].isOpen && strcmp(openFiles[i].fileName, fileName) == 0) {
-            printf("Error: File is already opened.\n");
-            return;
-        }
+    if (threads == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = online > 0 ? (unsigned int)online : 1;
+    }
+    if (threads > FSCK_MAX_THREADS) {
+        threads = FSCK_MAX_THREADS;
     }
 
-    //find an empty slot
-    int index = -1;
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (!openFiles[i].isOpen) {
-            index = i;
+    ImportState st;
+    memset(&st, 0, sizeof(st));
+    st.fd = fd;
+    st.bsi = bsi;
+    st.out = output();
+    st.nodes = nodes;
+    st.nodeCount = nodeCount;
+    st.clusters = clusters;
+    st.destCluster = dest.currentCluster;
+    pthread_mutex_init(&st.lock, NULL);
+
+    pthread_t tids[FSCK_MAX_THREADS];
+    unsigned int started = 0;
+    for (unsigned int t = 0; t < threads; t++) {
+        if (pthread_create(&tids[t], NULL, importWorker, &st) != 0) {
             break;
         }
+        started++;
+    }
+    if (started == 0) {
+        importWorker(&st);
+    }
+    for (unsigned int t = 0; t < started; t++) {
+        pthread_join(tids[t], NULL);
     }
+    pthread_mutex_destroy(&st.lock);
+    activeStats->syscalls += st.syscalls;
+    activeStats->bytesWritten += (unsigned long long)totalClusters * clusterSize;
 
-    if (index == -1) {
-        printf("Error: Too many open files.\n");
+    //nothing points at the new clusters yet, so a failed copy is undone by freeing them all
+    if (st.errors) {
+        reply("Error: %u problems while copying data, nothing was imported\n", st.errors);
+        importRelease(fd, clusters, totalClusters, bsi);
+        free(clusters);
+        freeImportNodes(nodes, nodeCount);
         return;
     }
 
-    //set flags based on mode
-    int flags = -1;
-    if (strcmp(mode, "-r") == 0) flags = 0;
-    else if (strcmp(mode, "-w") == 0) flags = 1;
-    else if (strcmp(mode, "-rw") == 0 || strcmp(mode, "-wr") == 0) flags = 2;
+    //commit: FAT copies and FSInfo once, then the new top level entries in one directory write per cluster
+    DirEntry* entries = malloc((topLevel ? topLevel : 1) * sizeof(DirEntry));
+    ok = entries && metadataFlush(fd, bsi);
+    for (unsigned int i = 0; ok && i < topLevel; i++) {
+        importEntry(&entries[i], nodes[i].name, nodes[i].isDirectory, nodes[i].firstCluster, nodes[i].size);
+    }
+    ok = ok && addEntries(fd, destDir, entries, topLevel, bsi);
+    free(entries);
 
-    if (flags == -1) {
-        printf("Error: Invalid mode.\n");
-        return;
+    double seconds = (monotonicMicros() - startMicros) / 1e6;
+    if (ok) {
+        status("Imported %u entries (%llu bytes, %llu clusters) into %s in %.2f s, %u threads, %s I/O\n",
+               nodeCount, st.bytes, totalClusters, dest.path, seconds, threads, ioEngineName());
+    } else {
+        reply("Error: Import could not be committed\n");
     }
+    free(clusters);
+    freeImportNodes(nodes, nodeCount);
+}
 
-    //find the file in the directory
-    unsigned char* buffer = malloc(bsi->bytesPerSector * bsi->sectorsPerCluster);
-    if (!buffer) {
-        printf("Failed to allocate memory for reading cluster\n");
+//copy every block the delta holds into the image, then empty the delta
+//the map is made durable first, so a commit that is cut short can simply be run again
+static void overlayCommit(int fd, BootSectorInfo* bsi, const char* imagePath) {
+    flushAllOpenFiles(fd, bsi);
+    if (!writeBackMetadata(fd, bsi) || !overlaySync(&activeStats->syscalls)) {
         return;
     }
-    if (!readCluster(fd, context->currentCluster, buffer, bsi)) {
+    int base = open(imagePath, O_WRONLY);
+    unsigned char* buffer = malloc(BULK_IO_SIZE > overlay.blockSize ? BULK_IO_SIZE : overlay.blockSize);
+    if (base < 0 || !buffer) {
+        if (base < 0) perror("Error opening image for writing");
+        else reply("Error: Not enough memory to commit the overlay\n");
+        if (base >= 0) close(base);
         free(buffer);
         return;
     }
 
-    DirEntry* entry = (DirEntry*)buffer;
-    int entriesCount = (bsi->bytesPerSector * bsi->sectorsPerCluster) / sizeof(DirEntry);
-    bool found = false;
-
-    //format the name and search for the correct entry
-    for (int i = 0; i < entriesCount; i++, entry++) {
-        if (entry->name[0] == 0x00) break; 
-        if ((unsigned char)entry->name[0] == 0xE5) continue; 
-
-        char formattedName[12];
-        strncpy(formattedName, entry->name, 11);
-        formattedName[11] = '\0';
-
-        for (int j = 10; j >= 0; j--) {
-            if (formattedName[j] == ' ') formattedName[j] = '\0';
-            else break;
+    //runs of consecutive blocks are copied in BULK_IO_SIZE pieces
+    size_t bufferBlocks = BULK_IO_SIZE / overlay.blockSize ? BULK_IO_SIZE / overlay.blockSize : 1;
+    unsigned long long blocks = 0, bytes = 0;
+    bool ok = true;
+    for (size_t block = 0; ok && block < overlay.blocks; block++) {
+        if (!overlayHas(block)) {
+            continue;
         }
-
-        if (strcmp(formattedName, fileName) == 0 && !(entry->attr & ATTR_DIRECTORY)) {
-            openFiles[index].isOpen = true;
-            strncpy(openFiles[index].fileName, fileName, 11);
-            openFiles[index].flags = flags;
-            openFiles[index].offset = 0;
-            openFiles[index].cluster = (entry->firstClusterHigh << 16) | entry->firstClusterLow;
-            openFiles[index].size = entry->fileSize;
-            found = true;
-            break;
+        size_t run = 1;
+        while (run < bufferBlocks && block + run < overlay.blocks && overlayHas(block + run)) {
+            run++;
         }
+        off_t offset = (off_t)block * overlay.blockSize;
+        size_t len = run * (size_t)overlay.blockSize;
+        if ((unsigned long long)offset + len > overlay.imageSize) len = overlay.imageSize - offset;
+        ok = overlayTransfer(overlay.fd, false, buffer, len, offset, &activeStats->syscalls) &&
+             overlayTransfer(base, true, buffer, len, offset, &activeStats->syscalls);
+        blocks += run;
+        bytes += len;
+        block += run - 1;
     }
+    activeStats->syscalls++;
+    if (ok && fdatasync(base) < 0) {
+        perror("Error syncing image");
+        ok = false;
+    }
+    close(base);
+    free(buffer);
+    activeStats->bytesRead += bytes;
+    activeStats->bytesWritten += bytes;
 
-    //print message indicating success or failure
-    if (!found) {
-        printf("Error: File not found.\n");
+    //the image now matches what was read through the overlay, the caches stay valid
+    if (ok && overlayReset(&activeStats->syscalls)) {
+        status("Committed %llu clusters (%llu bytes) to %s\n", blocks, bytes, imagePath);
     } else {
-        printf("File opened successfully: %s\n", fileName);
+        reply("Error: Commit did not finish, the overlay is unchanged, run it again\n");
     }
-
-    free(buffer);
 }
 
-//function to handles closing of a file
-void closeFile(const char* fileName) {
-    bool fileFound = false;
-    //search for files in the list of open files and if found, close it
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (openFiles[i].isOpen && strcmp(openFiles[i].fileName, fileName) == 0) {
-            openFiles[i].isOpen = false; 
-            printf("File closed successfully: %s\n", fileName);
-            fileFound = true;
-            break;
+//throw the delta away and reload everything cached from the unchanged image
+static void overlayDiscard(int fd, DirectoryContext* context, BootSectorInfo* bsi) {
+    if (sessionOut) {
+        reply("Error: Other sessions may be using the changes, discard is not available in server mode.\n");
+        return;
+    }
+    for (unsigned int h = 0; h < openTable.used; h++) {
+        if (openTable.files[h].isOpen) {
+            reply("Error: Close all open files first.\n");
+            return;
         }
     }
+    if (!overlayReset(&activeStats->syscalls)) {
+        return;
+    }
 
-    if (!fileFound) {
-        printf("Error: File not found or not opened.\n");
+    //held back FAT and directory changes are dropped along with the caches
+    dirCacheFree();
+    memset(dentryCache, 0, sizeof(dentryCache));
+    clusterCacheClear();
+    fatCacheFree();
+    allocatorFree();
+    groupCommit.pending = 0;
+    if (!fatCacheInit(bsi) || !allocatorInit(fd, bsi)) {
+        reply("Error: Could not reload the FAT after discarding the overlay\n");
+        return;
     }
+
+    //the working directory may have existed only in the overlay
+    context->currentCluster = bsi->rootCluster;
+    strcpy(context->path, "/");
+    context->depth = 0;
+    status("Overlay discarded\n");
 }
 
-//function to list all open files
-void listOpenFiles(DirectoryContext* context) {
-    bool anyFileOpen = false;
-    printf("Opened Files:\n");
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (openFiles[i].isOpen) {
-            anyFileOpen = true;
-            const char* modeString;
-            switch (openFiles[i].flags) {
-                case 0: modeString = "Read-Only"; break;
-                case 1: modeString = "Write-Only"; break;
-                case 2: modeString = "Read-Write"; break;
-                default: modeString = "Unknown"; break;
-            }
-            printf("Index: %d, File: %s, Mode: %s, Offset: %lu, Path: %s\n",
-                   i, openFiles[i].fileName, modeString, openFiles[i].offset, context->path);
+//function to handle overlay: show, commit or discard the changes held in the delta file
+void overlayCommand(int fd, const char* args, DirectoryContext* context, BootSectorInfo* bsi, const char* imagePath) {
+    if (overlay.fd < 0) {
+        reply("Error: Not running with an overlay, start with -o DELTA\n");
+    } else if (args[0] == '\0') {
+        size_t changed = 0;
+        for (size_t w = 0; w < (overlay.blocks + 63) / 64; w++) {
+            changed += __builtin_popcountll(overlay.present[w]);
         }
-    }
-
-    if (!anyFileOpen) {
-        printf("No files are currently opened.\n");
+        reply("Overlay %s: %zu of %zu clusters changed (%llu bytes)\n", overlayPath, changed, overlay.blocks,
+              (unsigned long long)changed * overlay.blockSize);
+    } else if (strcmp(args, "commit") == 0) {
+        overlayCommit(fd, bsi, imagePath);
+    } else if (strcmp(args, "discard") == 0) {
+        overlayDiscard(fd, context, bsi);
+    } else {
+        reply("Invalid command format. Usage: overlay [commit | discard]\n");
     }
 }
 
-//seek the offset of the file
-void seekFile(const char* fileName, unsigned long newOffset) {
-    bool fileFound = false;
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (openFiles[i].isOpen && strcmp(openFiles[i].fileName, fileName) == 0) {
-            fileFound = true;
-            if (newOffset > openFiles[i].size) {
-                printf("Error: Offset is larger than the size of the file.\n");
-            } else {
-                openFiles[i].offset = newOffset;
-                printf("Offset set to %lu for file: %s\n", newOffset, fileName);
-            }
-            break;
-        }
+//run one command line, returns false when the session should end
+bool executeCommand(int fd, const char* command, DirectoryContext* context, BootSectorInfo* bsi, const char* imagePath) {
+    //scratch buffers from the previous command are no longer referenced
+    arenaReset();
+
+    //charge I/O and latency to this command's type
+    int type = commandType(command);
+    activeStats = &commandStats[type];
+    unsigned long long startMicros = monotonicMicros();
+
+    //if statement to handle the different required commands for the system
+    if (strcmp(command, "exit") == 0) {
+        return false;
+    } else if (strcmp(command, "info") == 0) {
+        printBootSectorInfo(imagePath);
+    } else if (strncmp(command, "cd ", 3) == 0) {
+        char dirName[256];
+        sscanf(command + 3, "%s", dirName); 
+        changeDirectory(fd, dirName, context, bsi);
+    } else if (strcmp(command, "ls") == 0) {
+        listDirectory(fd, context, bsi);
+    } else if (strncmp(command, "mkdir ", 6) == 0) {
+        char dirName[256];
+        sscanf(command + 6, "%255s", dirName);
+        createDirectory(fd, dirName, context, bsi);
+    } else if (strncmp(command, "creat ", 6) == 0) {
+        char filename[256];
+        sscanf(command + 6, "%255s", filename);
+        createFile(fd, filename, context, bsi);
+    } else if (strncmp(command, "rm -r ", 6) == 0) {
+        char path[256];
+        sscanf(command + 6, "%255s", path);
+        removeTree(fd, path, context, bsi);
+    } else if (strncmp(command, "rm ", 3) == 0) {
+        char filename[256];
+        sscanf(command + 3, "%255s", filename);
+        removeFile(fd, filename, context, bsi);
+    } else if (strncmp(command, "rmdir ", 6) == 0) {
+        char dirName[256];
+        sscanf(command + 6, "%255s", dirName);
+        removeDirectory(fd, dirName, context, bsi);
+    } else if (strncmp(command, "open ", 5) == 0) {
+	    char fileName[256], mode[4];
+	    sscanf(command + 5, "%s %s", fileName, mode);
+	    openFile(fd, fileName, mode, context, bsi);
+	} else if (strncmp(command, "close ", 6) == 0) {
+        char fileName[256];
+	    sscanf(command + 6, "%255s", fileName);
+	    closeFile(fd, fileName, context, bsi);
+ 	} else if (strcmp(command, "lsof") == 0) {
+	    listOpenFiles(context);
+	} else if (strncmp(command, "lseek ", 6) == 0) {
+	    char fileName[256];
+	    unsigned long offset;
+	    if (sscanf(command + 6, "%s %lu", fileName, &offset) == 2) {
+    	seekFile(fd, fileName, offset, context, bsi);
+	    } else {
+    	reply("Invalid command format. Usage: lseek [FILENAME] [OFFSET]\n");
+	    }
+	} else if (strncmp(command, "read ", 5) == 0) {
+   	    char fileName[256];
+	    unsigned int size;
+	    if (sscanf(command + 5, "%s %u", fileName, &size) == 2) {
+    	readFile(fd, fileName, size, context, bsi);
+	    } else {
+    	reply("Invalid command format. Usage: read [FILENAME] [SIZE]\n");
+	    }
+	} else if (strncmp(command, "write ", 6) == 0) {
+	    char fileName[256];
+	    char data[1024]; 
+	  if (sscanf(command + 6, "%s \"%1023[^\"]\"", fileName, data) == 2) {
+        writeFile(fd, fileName, data, context, bsi);
+	  } else {
+        reply("Invalid command format. Usage: write [FILENAME] \"[STRING]\"\n");
+	  }
+	} else if (strcmp(command, "flush") == 0) {
+	    flushAllOpenFiles(fd, bsi);
+	    status("Flushed all open files\n");
+	} else if (strcmp(command, "sync") == 0) {
+	    flushAllOpenFiles(fd, bsi);
+	    if (commitMetadata(fd, bsi)) {
+	        status("Image synced\n");
+	    }
+	} else if (strcmp(command, "frag") == 0 || strncmp(command, "frag ", 5) == 0) {
+	    char path[256];
+	    showFragmentation(fd, sscanf(command + 4, "%255s", path) == 1 ? path : NULL, context, bsi);
+	} else if (strcmp(command, "defrag") == 0 || strncmp(command, "defrag ", 7) == 0) {
+	    char path[256];
+	    defragment(fd, sscanf(command + 6, "%255s", path) == 1 ? path : NULL, context, bsi);
+	} else if (strcmp(command, "overlay") == 0 || strncmp(command, "overlay ", 8) == 0) {
+	    overlayCommand(fd, command[7] ? command + 8 : "", context, bsi, imagePath);
+	} else if (strcmp(command, "stats") == 0 || strncmp(command, "stats ", 6) == 0) {
+	    showStats(command[5] ? command + 6 : "");
+	} else if (strcmp(command, "fsck") == 0 || strncmp(command, "fsck ", 5) == 0) {
+	    unsigned int threads = 0;
+	    if (command[4] && sscanf(command + 5, "-j %u", &threads) != 1) {
+	        reply("Invalid command format. Usage: fsck [-j THREADS]\n");
+	    } else {
+	        checkImage(fd, threads, bsi);
+	    }
+	} else if (strncmp(command, "export ", 7) == 0) {
+	    char dirName[256], hostPath[BULK_PATH_MAX / 2];
+	    unsigned int threads = 0;
+	    int fields = sscanf(command + 7, "%255s %511s -j %u", dirName, hostPath, &threads);
+	    if (fields < 2) {
+	        reply("Invalid command format. Usage: export [DIRECTORY] [HOSTPATH] [-j THREADS]\n");
+	    } else {
+	        exportTree(fd, dirName, hostPath, threads, context, bsi);
+	    }
+	} else if (strncmp(command, "import ", 7) == 0) {
+	    char hostPath[BULK_PATH_MAX / 2], dirName[256];
+	    unsigned int threads = 0;
+	    int fields = sscanf(command + 7, "%511s %255s -j %u", hostPath, dirName, &threads);
+	    if (fields < 2) {
+	        reply("Invalid command format. Usage: import [HOSTPATH] [DIRECTORY] [-j THREADS]\n");
+	    } else {
+	        importTree(fd, hostPath, dirName, threads, context, bsi);
+	    }
+	} else {
+        reply("Unknown command\n");
     }
 
-    if (!fileFound) {
-        printf("Error: File not found or not opened.\n");
+    //group commit: every interval-th command that changed metadata ends the group
+    if (groupCommit.interval > 0 && metadataDirty() && ++groupCommit.pending >= groupCommit.interval &&
+        !commitMetadata(fd, bsi)) {
+        reply("Error: Group commit failed, its changes are kept and retried with the next one\n");
     }
+    recordCommandLatency(&commandStats[type], monotonicMicros() - startMicros);
+    activeStats = &commandStats[CMD_OTHER];
+    return true;
 }
 
-//function to handle reading of a file
-void readFile(int fd, const char* fileName, unsigned int size, BootSectorInfo* bsi) {
-    bool fileFound = false;
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (openFiles[i].isOpen && strcmp(openFiles[i].fileName, fileName) == 0) {
-            if (openFiles[i].flags == 1) {
-                printf("Error: File is not opened for reading.\n");
-                return;
-            }
-            fileFound = true;
-            unsigned char* buffer = malloc(size);
-            if (!buffer) {
-                printf("Memory allocation failed\n");
-                return;
-            }
-            unsigned int readSize = size;
-            if (openFiles[i].offset + size > openFiles[i].size) {
-                readSize = openFiles[i].size - openFiles[i].offset;
-            }
+//hint the kernel about data that queued read commands are going to need
+//lookahead stops at the first command that could change file offsets or the open file table,
+//returns how many queued commands it covered (at least 1)
+int prefetchQueuedReads(int fd, char window[][256], int head, int count, BootSectorInfo* bsi) {
+    //offsets the queued reads will start at, indexed by handle
+    unsigned long* projected = malloc((openTable.used ? openTable.used : 1) * sizeof(unsigned long));
+    if (!projected) {
+        return 1;
+    }
+    for (unsigned int h = 0; h < openTable.used; h++) {
+        projected[h] = openTable.files[h].offset;
+    }
 
-            //calculate starting sector and offset within the sector
-            unsigned int cluster = openFiles[i].cluster;
-            unsigned int sectorOffset = (openFiles[i].offset / bsi->bytesPerSector) % bsi->sectorsPerCluster;
-            unsigned int byteOffset = openFiles[i].offset % bsi->bytesPerSector;
-            unsigned int bytesRead = 0;
+    int covered = 0;
+    while (covered < count) {
+        const char* command = window[(head + covered) % BATCH_LOOKAHEAD];
+        covered++;
 
-            //seek file and attempt tor read - calculate te number of bytes needed to read
-            while (bytesRead < readSize) {
-                unsigned long long sector = ((cluster - 2) * bsi->sectorsPerCluster) + bsi->rootCluster + sectorOffset;
-                off_t sectorStart = sector * bsi->bytesPerSector;
+        //other read-only commands do not disturb the projection
+        if (strcmp(command, "ls") == 0 || strcmp(command, "lsof") == 0 || strcmp(command, "info") == 0) {
+            continue;
+        }
+        char fileName[256];
+        unsigned int size;
+        if (strncmp(command, "read ", 5) != 0 || sscanf(command + 5, "%255s %u", fileName, &size) != 2) {
+            break;
+        }
 
-                if (lseek(fd, sectorStart + byteOffset, SEEK_SET) < 0) {
-                    perror("Error seeking file");
-                    free(buffer);
-                    return;
+        //only a hint: names are matched as typed at open, without resolving the path
+        OpenFile* file = NULL;
+        if (isHandle(fileName)) {
+            file = fileByHandle(strtol(fileName, NULL, 10));
+        } else {
+            for (unsigned int h = 0; h < openTable.used && !file; h++) {
+                if (openTable.files[h].isOpen && strcmp(openTable.files[h].fileName, fileName) == 0) {
+                    file = &openTable.files[h];
                 }
+            }
+        }
+        if (!file) {
+            continue;
+        }
 
-                unsigned int bytesToRead = bsi->bytesPerSector - byteOffset;
-                if (bytesRead + bytesToRead > readSize) {
-                    bytesToRead = readSize - bytesRead;
-                }
+        unsigned long* at = &projected[file - openTable.files];
+        unsigned long end = *at + size;
+        if (end > file->size) end = file->size;
+        while (*at < end) {
+            size_t contiguous;
+            off_t physical = mapFileOffset(fd, file, *at, &contiguous, bsi);
+            if (physical < 0) {
+                *at = end;
+                break;
+            }
+            if (contiguous > end - *at) contiguous = end - *at;
+            imagePrefetch(fd, physical, contiguous);
+            *at += contiguous;
+        }
+    }
+    free(projected);
+    return covered;
+}
 
-                if (read(fd, buffer + bytesRead, bytesToRead) < 0) {
-                    perror("Error reading file");
-                    free(buffer);
-                    return;
-                }
+//batch mode: commands come from a script or a pipe, prompts and status messages are off,
+//stdout is fully buffered, and a window of queued commands is read ahead so the data of
+//consecutive reads is already being fetched while earlier ones run
+void runBatch(int fd, FILE* input, DirectoryContext* context, BootSectorInfo* bsi, const char* imagePath) {
+    static char window[BATCH_LOOKAHEAD][256];
+    int head = 0, count = 0, hinted = 0;
+    bool eof = false;
 
-                //reset byte offset for the next secto
-                bytesRead += bytesToRead;
-                byteOffset = 0;
-                sectorOffset++;
-                if (sectorOffset >= bsi->sectorsPerCluster) {
-                    sectorOffset = 0;
-                    cluster = getNextCluster(fd, cluster, bsi);
-                }
+    while (1) {
+        while (!eof && count < BATCH_LOOKAHEAD) {
+            char* line = window[(head + count) % BATCH_LOOKAHEAD];
+            if (!fgets(line, 256, input)) {
+                eof = true;
+                break;
             }
+            line[strcspn(line, "\n")] = 0;
+            count++;
+        }
+        if (count == 0) {
+            break;
+        }
 
-            printf("%.*s", bytesRead, buffer); 
-            free(buffer);
+        if (hinted == 0) {
+            hinted = prefetchQueuedReads(fd, window, head, count, bsi);
+        }
+        const char* command = window[head];
+        head = (head + 1) % BATCH_LOOKAHEAD;
+        count--;
+        hinted--;
 
-            //update offset
-            openFiles[i].offset += bytesRead;
-            printf("\nRead %u bytes from file: %s\n", bytesRead, fileName);
+        if (!executeCommand(fd, command, context, bsi, imagePath)) {
             break;
         }
     }
+}
 
-    if (!fileFound) {
-        printf("Error: File not found or not opened.\n");
+//open an image, parse its boot sector and set up the FAT cache, allocator, cluster cache and arena
+//returns the image fd, or -1 after printing why the image could not be mounted
+int mountImage(const char* imagePath, bool useMmap, unsigned int cacheClusters, BootSectorInfo* out) {
+    activeStats = &commandStats[CMD_OTHER];
+    //with an overlay the image itself is never written
+    int fd = open(imagePath, overlayPath ? O_RDONLY : O_RDWR);
+    if (fd == -1) {
+        perror("Error opening file");
+        return -1;
     }
-}
 
-//fucntion to handle finidng of the next cluster
-unsigned int getNextCluster(int fd, unsigned int currentCluster, BootSectorInfo* bsi) {
-    if (currentCluster < 2) {
-        fprintf(stderr, "Invalid cluster number: %u\n", currentCluster);
-        return 0xFFFFFFFF; //error
+    //read the boot sector to initialize the BootSectorInfo
+    unsigned char bootSector[512];
+    if (read(fd, bootSector, sizeof(bootSector)) != sizeof(bootSector)) {
+        perror("Failed to read boot sector");
+        close(fd);
+        return -1;
+    }
+
+    //initialize the boot sector info
+    BootSectorInfo bsi = {
+        .bytesPerSector = *(unsigned short *)(bootSector + 11),
+        .sectorsPerCluster = *(bootSector + 13),
+        .rootCluster = *(unsigned int *)(bootSector + 44),
+        .sectorsPerFAT = *(unsigned int *)(bootSector + 36),
+        .sizeOfImage = lseek(fd, 0, SEEK_END),
+        .reservedSectors = *(unsigned short *)(bootSector + 14),
+        .numFATs = *(bootSector + 16),
+        .fsInfoSector = *(unsigned short *)(bootSector + 48),
+        .totalSectors = *(unsigned short *)(bootSector + 19)
+    };
+    if (bsi.totalSectors == 0) bsi.totalSectors = *(unsigned int *)(bootSector + 32);
+    bsi.firstDataSector = bsi.reservedSectors + bsi.numFATs * bsi.sectorsPerFAT;
+
+    if (bsi.bytesPerSector == 0 || bsi.sectorsPerCluster == 0 || bsi.totalSectors <= bsi.firstDataSector) {
+        printf("Error: Image does not have a valid FAT32 boot sector\n");
+        close(fd);
+        return -1;
     }
+    bsi.totalClusters = (bsi.sizeOfImage / (bsi.sectorsPerCluster * bsi.bytesPerSector));
 
-    //FAT32 cluster entry is 4 bytes
-    unsigned int fatOffset = currentCluster * 4;
-    unsigned int fatSector = bsi->rootCluster + (fatOffset / bsi->bytesPerSector);
-    unsigned int entOffset = fatOffset % bsi->bytesPerSector;
+    //usable clusters are bounded by both the data region and the FAT size
+    bsi.maxCluster = 2 + (bsi.totalSectors - bsi.firstDataSector) / bsi.sectorsPerCluster;
+    if (bsi.maxCluster > (bsi.sectorsPerFAT * bsi.bytesPerSector) / 4) {
+        bsi.maxCluster = (bsi.sectorsPerFAT * bsi.bytesPerSector) / 4;
+    }
 
-    //buffer to read the entry
-    unsigned char buffer[4]; 
+    //reset the file descriptor position for further operations
+    lseek(fd, 0, SEEK_SET); 
 
-    //calculate the position to seek
-    off_t position = fatSector * bsi->bytesPerSector + entOffset;
+    if (overlayPath && !overlayOpen(overlayPath, bsi.sizeOfImage, bsi.bytesPerSector * bsi.sectorsPerCluster)) {
+        close(fd);
+        return -1;
+    }
 
-    if (lseek(fd, position, SEEK_SET) < 0) {
-        perror("Error seeking in FAT");
-        return 0xFFFFFFFF;  
+    //map the image if requested, falling back to pread/pwrite
+    if (useMmap && overlayPath) {
+        printf("The overlay uses file I/O, ignoring -m\n");
+    } else if (useMmap && !mapImage(fd, bsi.sizeOfImage)) {
+        printf("Falling back to file I/O\n");
     }
 
-    //read the next cluster value
-    if (read(fd, buffer, 4) != 4) {
-        perror("Error reading FAT entry");
-        return 0xFFFFFFFF;
+    selectScanKernels();
+    //probe io_uring once so the summaries report the engine that is really used
+#ifdef HAVE_IO_URING
+    if (!ioRingGet()) {
+        ioQueueDepth = 0;
+    }
+#else
+    ioQueueDepth = 0;
+#endif
+    size_t arenaSize = (size_t)ARENA_CLUSTERS * bsi.bytesPerSector * bsi.sectorsPerCluster + READ_STAGING_SIZE;
+    if (!fatCacheInit(&bsi) || !allocatorInit(fd, &bsi) || !clusterCacheInit(cacheClusters, &bsi) || !arenaInit(arenaSize)) {
+        fatCacheFree();
+        allocatorFree();
+        clusterCacheFree();
+        arenaFree();
+        ioRingFree();
+        unmapImage();
+        overlayClose();
+        close(fd);
+        return -1;
     }
 
-    //calculate next cluster from the entry
-    unsigned int nextCluster = *(unsigned int*)buffer & 0x0FFFFFFF; 
+    *out = bsi;
+    return fd;
+}
 
-    //end of cluster chain markers
-    if (nextCluster >= 0x0FFFFFF8) {
-        return 0xFFFFFFFF; 
+//flush and release every file in this thread's open file table
+void closeAllOpenFiles(int fd, BootSectorInfo* bsi) {
+    flushAllOpenFiles(fd, bsi);
+    for (unsigned int h = 0; h < openTable.used; h++) {
+        if (openTable.files[h].isOpen) {
+            releaseHandle(h);
+        }
     }
-    return nextCluster;
+    freeOpenTable();
 }
 
-//fucntion to handle writing to file NOT WORKING we tried :(
-void writeFile(int fd, const char* fileName, const char* data, BootSectorInfo* bsi) {
-    int i;
-    for (i = 0; i < MAX_OPEN_FILES; i++) {
-        if (openFiles[i].isOpen && strcmp(openFiles[i].fileName, fileName) == 0) {
-            if (openFiles[i].flags == 0) {
-                printf("Error: File is not opened for writing.\n");
-                return;
-            }
+//flush and close every open file, write back FAT and FSInfo, and release all caches
+void unmountImage(int fd, BootSectorInfo* bsi) {
+    closeAllOpenFiles(fd, bsi);
+    if (groupCommit.interval > 0) commitMetadata(fd, bsi);
+    else writeBackMetadata(fd, bsi);
+    fatCacheFree();
+    allocatorFree();
+    dirCacheFree();
+    clusterCacheFree();
+    arenaFree();
+    ioRingFree();
+    unmapImage();
+    overlayClose();
+    close(fd);
+}
 
-            unsigned int dataSize = strlen(data);
-            unsigned int newOffset = openFiles[i].offset + dataSize;
+//main, left out when another program (the benchmark) includes this file
+//server mode: one mounted image shared by many client sessions over a Unix socket
+//each session thread has its own cwd, open files, caches and scratch arena; commands that only
+//read the image share imageLock, anything that writes holds it alone and bumps imageGeneration
+//so the other sessions drop their cached directories and clusters before their next command
+pthread_rwlock_t imageLock = PTHREAD_RWLOCK_INITIALIZER;
+unsigned long imageGeneration = 0;
+volatile sig_atomic_t stopServer = 0;
 
-            //check if the offset exceeds the file size and adjust file size 
-            if (newOffset > openFiles[i].size) {
-                openFiles[i].size = newOffset;  
-            }
+typedef struct {
+    int client;
+    int fd;
+    BootSectorInfo* bsi;
+    const char* imagePath;
+    unsigned int cacheClusters;
+} Session;
 
-            //writing data to file starting at the current offset
-            unsigned int cluster = openFiles[i].cluster;
-            unsigned int sectorOffset = (openFiles[i].offset / bsi->bytesPerSector) % bsi->sectorsPerCluster;
-            unsigned int byteOffset = openFiles[i].offset % bsi->bytesPerSector;
-            unsigned int bytesWritten = 0;
+//commands that never write the image as long as the session has nothing buffered
+static bool readOnlyCommand(int type) {
+    return type == CMD_INFO || type == CMD_CD || type == CMD_LS || type == CMD_LSOF ||
+           type == CMD_LSEEK || type == CMD_READ || type == CMD_STATS || type == CMD_EXPORT || type == CMD_FRAG;
+}
 
-            while (bytesWritten < dataSize) {
-                unsigned long long sector = ((cluster - 2) * bsi->sectorsPerCluster) + bsi->rootCluster + sectorOffset;
-                off_t sectorStart = sector * bsi->bytesPerSector;
+static bool hasPendingWrites() {
+    for (unsigned int h = 0; h < openTable.used; h++) {
+        OpenFile* file = &openTable.files[h];
+        if (file->isOpen && (file->entryDirty || file->dirtyEnd > file->dirtyStart)) {
+            return true;
+        }
+    }
+    return false;
+}
 
-                if (lseek(fd, sectorStart + byteOffset, SEEK_SET) < 0) {
-                    perror("Error seeking in file for writing");
-                    return;
-                }
+//drop everything this session cached if another session wrote since its last command
+static void syncSession(int fd, unsigned long* seenGeneration, BootSectorInfo* bsi) {
+    if (*seenGeneration == imageGeneration) {
+        return;
+    }
+    dirCacheFree();
+    memset(dentryCache, 0, sizeof(dentryCache));
+    clusterCacheClear();
 
-                unsigned int bytesToWrite = bsi->bytesPerSector - byteOffset;
-                if (bytesWritten + bytesToWrite > dataSize) {
-                    bytesToWrite = dataSize - bytesWritten;
-                }
+    //sizes and chains of open files may have changed under us
+    for (unsigned int h = 0; h < openTable.used; h++) {
+        OpenFile* file = &openTable.files[h];
+        if (!file->isOpen) {
+            continue;
+        }
+        invalidateExtents(file);
+        readAheadDrop(file);
+        DirCache* dir = file->entryDirty ? NULL : loadDirectory(fd, file->dirCluster, bsi);
+        if (dir && file->entryIndex < dir->endIndex && (unsigned char)dir->entries[file->entryIndex].name[0] != 0xE5) {
+            file->size = dir->entries[file->entryIndex].fileSize;
+            file->cluster = entryCluster(&dir->entries[file->entryIndex]);
+            if (file->offset > file->size) file->offset = file->size;
+        }
+    }
+    *seenGeneration = imageGeneration;
+}
 
-                if (write(fd, data + bytesWritten, bytesToWrite) < 0) {
-                    perror("Error writing to file");
-                    return;
-                }
+static void* sessionThread(void* arg) {
+    Session* session = arg;
+    int fd = session->fd;
+    BootSectorInfo* bsi = session->bsi;
+    FILE* in = fdopen(session->client, "r");
+    int outFd = dup(session->client);
+    FILE* out = outFd >= 0 ? fdopen(outFd, "w") : NULL;
+    if (!in || !out) {
+        perror("Error starting session");
+        if (in) fclose(in); else close(session->client);
+        if (out) fclose(out); else if (outFd >= 0) close(outFd);
+        free(session);
+        return NULL;
+    }
 
-                //reset byte offset for the next sector
-                bytesWritten += bytesToWrite;
-                byteOffset = 0; 
-                sectorOffset++;
-                if (sectorOffset >= bsi->sectorsPerCluster) {
-                    sectorOffset = 0;
-                    cluster = getNextCluster(fd, cluster, bsi);
-                    if (cluster == 0xFFFFFFFF) {
-                        printf("Error: Failed to find next cluster.\n");
-                        return;
-                    }
-                }
-            }
+    //per-session state lives in this thread's copies of the globals
+    sessionOut = out;
+    activeStats = &commandStats[CMD_OTHER];
+    size_t arenaSize = (size_t)ARENA_CLUSTERS * bsi->bytesPerSector * bsi->sectorsPerCluster + READ_STAGING_SIZE;
+    if (!arenaInit(arenaSize) || !clusterCacheInit(session->cacheClusters, bsi)) {
+        clusterCacheFree();
+        arenaFree();
+        fclose(in);
+        fclose(out);
+        free(session);
+        return NULL;
+    }
+
+    DirectoryContext context = {bsi->rootCluster, "/", "", {0}, 0};
+    snprintf(context.imageName, sizeof(context.imageName), "%s", session->imagePath);
+    pthread_rwlock_wrlock(&imageLock);
+    bool registered = registerContext(&context);
+    pthread_rwlock_unlock(&imageLock);
+    if (!registered) {
+        fprintf(out, "Error: Out of memory for the session table\n");
+        clusterCacheFree();
+        arenaFree();
+        fclose(in);
+        fclose(out);
+        free(session);
+        return NULL;
+    }
+    unsigned long seenGeneration = imageGeneration;
+    char command[256];
 
-            openFiles[i].offset = newOffset;
-            printf("Data written successfully to file: %s\n", fileName);
+    while (!stopServer) {
+        fprintf(out, "[%s%s]/> ", context.imageName, context.path);
+        fflush(out);
+        if (!fgets(command, sizeof(command), in)) {
+            break;
+        }
+        command[strcspn(command, "\r\n")] = 0;
+
+        bool writer = !readOnlyCommand(commandType(command)) || hasPendingWrites();
+        if (writer) pthread_rwlock_wrlock(&imageLock);
+        else pthread_rwlock_rdlock(&imageLock);
+        syncSession(fd, &seenGeneration, bsi);
+        bool running = executeCommand(fd, command, &context, bsi, session->imagePath);
+        if (writer) {
+            //other sessions read the image, so held back metadata cannot outlive the lock
+            writeBackMetadata(fd, bsi);
+            seenGeneration = ++imageGeneration;
+        }
+        pthread_rwlock_unlock(&imageLock);
+        fflush(out);
+        if (!running) {
             break;
         }
     }
 
-    if (i == MAX_OPEN_FILES) {
-        printf("Error: File not found or not opened.\n");
+    //a departing session commits its files like exit does
+    pthread_rwlock_wrlock(&imageLock);
+    unregisterContext(&context);
+    syncSession(fd, &seenGeneration, bsi);
+    closeAllOpenFiles(fd, bsi);
+    if (groupCommit.interval > 0) commitMetadata(fd, bsi);
+    else writeBackMetadata(fd, bsi);
+    imageGeneration++;
+    pthread_rwlock_unlock(&imageLock);
+
+    dirCacheFree();
+    clusterCacheFree();
+    arenaFree();
+    ioRingFree();
+    fclose(in);
+    fclose(out);
+    free(session);
+    return NULL;
+}
+
+static void handleStopSignal(int sig) {
+    (void)sig;
+    stopServer = 1;
+}
+
+//accept clients until SIGINT or SIGTERM, one detached thread per session
+bool serveImage(int fd, const char* socketPath, const char* imagePath, unsigned int cacheClusters, BootSectorInfo* bsi) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+        printf("Error: Socket path too long: %s\n", socketPath);
+        return false;
+    }
+    strcpy(addr.sun_path, socketPath);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        perror("Error creating socket");
+        return false;
+    }
+    unlink(socketPath);
+    if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listener, SERVER_BACKLOG) < 0) {
+        perror("Error listening on socket");
+        close(listener);
+        return false;
+    }
+
+    //no SA_RESTART so a signal breaks accept
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handleStopSignal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("Serving %s on %s\n", imagePath, socketPath);
+    fflush(stdout);
+    while (!stopServer) {
+        int client = accept(listener, NULL, NULL);
+        if (client < 0) {
+            if (errno != EINTR) perror("Error accepting client");
+            continue;
+        }
+        Session* session = malloc(sizeof(Session));
+        pthread_t tid;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (!session) {
+            close(client);
+        } else {
+            *session = (Session){client, fd, bsi, imagePath, cacheClusters};
+            if (pthread_create(&tid, &attr, sessionThread, session) != 0) {
+                perror("Error starting session");
+                close(client);
+                free(session);
+            }
+        }
+        pthread_attr_destroy(&attr);
     }
+
+    close(listener);
+    unlink(socketPath);
+
+    //sessions still connected have their buffered writes dropped, what they committed stays
+    pthread_rwlock_wrlock(&imageLock);
+    return true;
 }
 
-//main
+#ifndef FAT_NO_MAIN
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        printf("Usage: ./filesys [FAT32 ISO]\n");
+    if (argc < 2) {
+        printf("Usage: ./filesys [FAT32 ISO] [-m] [-c CLUSTERS] [-q DEPTH] [-G COMMANDS] [-o DELTA] [-b SCRIPT | -s SOCKET]\n");
         return 1;
     }
 
-    int fd = open(argv[1], O_RDWR);
-    if (fd == -1) {
-        perror("Error opening file");
-        return 1;
+    //optional flags after the image name
+    bool useMmap = false;
+    unsigned int cacheClusters = DEFAULT_CACHE_CLUSTERS;
+    const char* scriptPath = NULL;
+    const char* socketPath = NULL;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--mmap") == 0) {
+            useMmap = true;
+        } else if ((strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--cache") == 0) && i + 1 < argc) {
+            cacheClusters = strtoul(argv[++i], NULL, 10);
+        } else if ((strcmp(argv[i], "-q") == 0 || strcmp(argv[i], "--queue-depth") == 0) && i + 1 < argc) {
+            ioQueueDepth = strtoul(argv[++i], NULL, 10);
+            if (ioQueueDepth > IO_BATCH_MAX) ioQueueDepth = IO_BATCH_MAX;
+        } else if ((strcmp(argv[i], "-G") == 0 || strcmp(argv[i], "--group-commit") == 0) && i + 1 < argc) {
+            groupCommit.interval = strtoul(argv[++i], NULL, 10);
+        } else if ((strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "--overlay") == 0) && i + 1 < argc) {
+            overlayPath = argv[++i];
+        } else if ((strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--batch") == 0) && i + 1 < argc) {
+            scriptPath = argv[++i];
+        } else if ((strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--serve") == 0) && i + 1 < argc) {
+            socketPath = argv[++i];
+        } else {
+            printf("Unknown option: %s\n", argv[i]);
+            printf("Usage: ./filesys [FAT32 ISO] [-m] [-c CLUSTERS] [-q DEPTH] [-G COMMANDS] [-o DELTA] [-b SCRIPT | -s SOCKET]\n");
+            return 1;
+        }
     }
 
-    //read the boot sector to initialize the BootSectorInfo
-    unsigned char bootSector[512];
-    if (read(fd, bootSector, sizeof(bootSector)) != sizeof(bootSector)) {
-        perror("Failed to read boot sector");
-        close(fd);
+    if (scriptPath && socketPath) {
+        printf("Error: -b and -s cannot be combined\n");
         return 1;
     }
+    //sessions talk to their clients, never to a script
+    batchMode = !socketPath && (scriptPath != NULL || !isatty(STDIN_FILENO));
 
-    //initialize the boot sector info
-    BootSectorInfo bsi = {
-        .bytesPerSector = *(unsigned short *)(bootSector + 11),
-        .sectorsPerCluster = *(bootSector + 13),
-        .rootCluster = *(unsigned int *)(bootSector + 44),
-        .sectorsPerFAT = *(unsigned int *)(bootSector + 36),
-        .sizeOfImage = lseek(fd, 0, SEEK_END) 
-    };
-    bsi.totalClusters = (bsi.sizeOfImage / (bsi.sectorsPerCluster * bsi.bytesPerSector));
-
-    //reset the file descriptor position for further operations
-    lseek(fd, 0, SEEK_SET); 
+    BootSectorInfo bsi;
+    int fd = mountImage(argv[1], useMmap, cacheClusters, &bsi);
+    if (fd < 0) {
+        return 1;
+    }
 
     //initialize the directory context
-    DirectoryContext context = {2, "/", ""}; 
+    DirectoryContext context = {bsi.rootCluster, "/", "", {0}, 0}; 
     strncpy(context.imageName, argv[1], sizeof(context.imageName) - 1); 
     context.imageName[sizeof(context.imageName) - 1] = '\0'; 
 
+    //daemon mode: the image stays mounted until the server is stopped
+    if (socketPath) {
+        bool served = serveImage(fd, socketPath, argv[1], cacheClusters, &bsi);
+        unmountImage(fd, &bsi);
+        return served ? 0 : 1;
+    }
+
+    //the only session outside server mode
+    registerContext(&context);
+
+    //scripts and pipes run in batch mode, a script that cannot be opened fails the run
+    int exitStatus = 0;
+    if (batchMode) {
+        static char outputBuffer[1 << 16];
+        setvbuf(stdout, outputBuffer, _IOFBF, sizeof(outputBuffer));
+        FILE* input = stdin;
+        if (scriptPath && !(input = fopen(scriptPath, "r"))) {
+            perror("Error opening script");
+            exitStatus = 1;
+        } else {
+            runBatch(fd, input, &context, &bsi, argv[1]);
+            if (input != stdin) fclose(input);
+        }
+    }
+
     char command[256];
     //initialize infinite loop of the prompt
-    while (1) {
+    while (!batchMode) {
         printf("[%s%s]/> ", context.imageName, context.path); 
         if (!fgets(command, sizeof(command), stdin)) {
             break; 
         }
         command[strcspn(command, "\n")] = 0; 
 
-        //if statement to handle the different required commands for the system
-        if (strcmp(command, "exit") == 0) {
+        if (!executeCommand(fd, command, &context, &bsi, argv[1])) {
             break;
-        } else if (strcmp(command, "info") == 0) {
-            printBootSectorInfo(argv[1]);
-        } else if (strncmp(command, "cd ", 3) == 0) {
-            char dirName[256];
-            sscanf(command + 3, "%s", dirName); 
-            changeDirectory(fd, dirName, &context, &bsi);
-        } else if (strcmp(command, "ls") == 0) {
-            listDirectory(fd, &context, &bsi);
-        } else if (strncmp(command, "mkdir ", 6) == 0) {
-            char dirName[256];
-            sscanf(command + 6, "%255s", dirName);
-            createDirectory(fd, dirName, &context, &bsi);
-        } else if (strncmp(command, "creat ", 6) == 0) {
-            char filename[256];
-            sscanf(command + 6, "%255s", filename);
-            createFile(fd, filename, &context, &bsi);
-        } else if (strncmp(command, "rm ", 3) == 0) {
-            char filename[256];
-            sscanf(command + 3, "%255s", filename);
-            removeFile(fd, filename, &context, &bsi);
-        } else if (strncmp(command, "rmdir ", 6) == 0) {
-            char dirName[256];
-            sscanf(command + 6, "%255s", dirName);
-            removeDirectory(fd, dirName, &context, &bsi);
-        } else if (strncmp(command, "open ", 5) == 0) {
-    	    char fileName[256], mode[4];
-    	    sscanf(command + 5, "%s %s", fileName, mode);
-    	    openFile(fd, fileName, mode, &context, &bsi);
-	} else if (strncmp(command, "close ", 6) == 0) {
-            char fileName[256];
-    	    sscanf(command + 6, "%255s", fileName);
-    	    closeFile(fileName);
- 	} else if (strcmp(command, "lsof") == 0) {
-	    listOpenFiles(&context);
-	} else if (strncmp(command, "lseek ", 6) == 0) {
-    	    char fileName[256];
-    	    unsigned long offset;
-    	    if (sscanf(command + 6, "%s %lu", fileName, &offset) == 2) {
-        	seekFile(fileName, offset);
-    	    } else {
-        	printf("Invalid command format. Usage: lseek [FILENAME] [OFFSET]\n");
-    	    }
-	} else if (strncmp(command, "read ", 5) == 0) {
-   	    char fileName[256];
-    	    unsigned int size;
-    	    if (sscanf(command + 5, "%s %u", fileName, &size) == 2) {
-        	readFile(fd, fileName, size, &bsi);
-    	    } else {
-        	printf("Invalid command format. Usage: read [FILENAME] [SIZE]\n");
-    	    }
-	} else if (strncmp(command, "write ", 6) == 0) {
-    	    char fileName[256];
-    	    char data[1024]; 
-    	  if (sscanf(command + 6, "%s \"%1023[^\"]\"", fileName, data) == 2) {
-            writeFile(fd, fileName, data, &bsi);
-    	  } else {
-            printf("Invalid command format. Usage: write [FILENAME] \"[STRING]\"\n");
-    	  }
-	} else {
-            printf("Unknown command\n");
         }
     }
 
-    close(fd);
-    return 0;
+    unmountImage(fd, &bsi);
+
+    //FAT_STATS in the environment dumps the counters to stderr on exit
+    if (getenv("FAT_STATS")) {
+        printStats(stderr);
+    }
+    return exitStatus;
 }
+#endif
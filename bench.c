@@ -0,0 +1,490 @@
+//benchmark harness: builds a synthetic FAT32 image and times workloads against the
+//command handlers in FAT.c, which is compiled into this program without its main
+#define FAT_NO_MAIN
+#include "FAT.c"
+
+#include <time.h>
+
+#define BENCH_RESERVED_SECTORS 32
+#define BENCH_NUM_FATS 2
+#define BENCH_RECORD_SIZE 100
+
+typedef struct {
+    const char* imagePath;
+    unsigned int imageMB;
+    unsigned int sectorsPerCluster;
+    unsigned int fanout;            //subdirectories per directory
+    unsigned int depth;             //levels of subdirectories below the root
+    unsigned int filesPerDir;
+    unsigned int bigFileMB;         //size of BIG.DAT used by the read workloads
+    unsigned int fragmentation;     //percent chance each BIG.DAT cluster starts a new run
+    unsigned int iterations;
+    unsigned int seed;
+    bool useMmap;
+    unsigned int cacheClusters;
+    bool keepImage;
+} BenchConfig;
+
+//state while laying out a new image: the FAT lives in memory until the end
+typedef struct {
+    int fd;
+    BenchConfig* cfg;
+    unsigned int clusterSize;
+    unsigned int sectorsPerFAT;
+    unsigned int firstDataSector;
+    unsigned int maxCluster;
+    uint32_t* fat;
+    unsigned int nextCluster;
+    unsigned int usedClusters;
+} ImageBuilder;
+
+//one timed workload, latencies in microseconds
+typedef struct {
+    const char* name;
+    double* samples;
+    unsigned int count;
+    unsigned int capacity;
+    unsigned long long bytes;
+    double totalMicros;
+} Workload;
+
+static double nowMicros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static off_t builderOffset(ImageBuilder* b, unsigned int cluster) {
+    return ((off_t)b->firstDataSector + (off_t)(cluster - 2) * b->cfg->sectorsPerCluster) * 512;
+}
+
+//allocate a chain of count clusters, jumping ahead by a few clusters with probability fragPercent
+static unsigned int buildChain(ImageBuilder* b, unsigned int count, unsigned int fragPercent) {
+    unsigned int first = 0, prev = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        if (prev && fragPercent && (unsigned int)(rand() % 100) < fragPercent) {
+            b->nextCluster += 1 + rand() % 16;
+        }
+        if (b->nextCluster >= b->maxCluster) {
+            fprintf(stderr, "Image too small for the requested layout\n");
+            exit(1);
+        }
+        unsigned int cluster = b->nextCluster++;
+        b->fat[cluster] = 0x0FFFFFFF;
+        if (prev) b->fat[prev] = cluster;
+        else first = cluster;
+        prev = cluster;
+        b->usedClusters++;
+    }
+    return first;
+}
+
+static void makeEntry(DirEntry* entry, const char* name, uint8_t attr, unsigned int cluster, unsigned int size) {
+    memset(entry, 0, sizeof(DirEntry));
+    packName(name, entry->name);
+    entry->attr = attr;
+    entry->firstClusterHigh = cluster >> 16;
+    entry->firstClusterLow = cluster & 0xFFFF;
+    entry->fileSize = size;
+}
+
+static unsigned int dirClustersFor(ImageBuilder* b, unsigned int entries) {
+    unsigned int perCluster = b->clusterSize / sizeof(DirEntry);
+    return (entries + perCluster - 1) / perCluster;
+}
+
+//write entries across the chain starting at cluster, the rest of the chain stays zero
+static void writeEntries(ImageBuilder* b, unsigned int cluster, DirEntry* entries, unsigned int count) {
+    unsigned int perCluster = b->clusterSize / sizeof(DirEntry);
+    for (unsigned int i = 0; i < count; i += perCluster) {
+        unsigned int n = count - i < perCluster ? count - i : perCluster;
+        if (pwrite(b->fd, entries + i, n * sizeof(DirEntry), builderOffset(b, cluster)) < 0) {
+            perror("Error writing directory");
+            exit(1);
+        }
+        cluster = b->fat[cluster] & FAT_ENTRY_MASK;
+    }
+}
+
+//one-cluster file holding a short line of text
+static unsigned int buildSmallFile(ImageBuilder* b, unsigned int id, unsigned int* size) {
+    char text[64];
+    int len = snprintf(text, sizeof(text), "synthetic file %u\n", id);
+    unsigned int cluster = buildChain(b, 1, 0);
+    if (pwrite(b->fd, text, len, builderOffset(b, cluster)) < 0) {
+        perror("Error writing file");
+        exit(1);
+    }
+    *size = len;
+    return cluster;
+}
+
+//directory with fanout subdirectories D0..Dn (until depth is reached) and files F0..Fn.DAT
+static unsigned int buildTree(ImageBuilder* b, unsigned int cluster, unsigned int parent, unsigned int level) {
+    unsigned int subdirs = level < b->cfg->depth ? b->cfg->fanout : 0;
+    unsigned int count = 2 + subdirs + b->cfg->filesPerDir;
+    DirEntry* entries = calloc(count, sizeof(DirEntry));
+    if (!entries) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+
+    makeEntry(&entries[0], ".", ATTR_DIRECTORY, cluster, 0);
+    makeEntry(&entries[1], "..", ATTR_DIRECTORY, parent, 0);
+    unsigned int n = 2;
+    for (unsigned int i = 0; i < subdirs; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "D%u", i);
+        unsigned int childEntries = 2 + (level + 1 < b->cfg->depth ? b->cfg->fanout : 0) + b->cfg->filesPerDir;
+        unsigned int child = buildChain(b, dirClustersFor(b, childEntries), 0);
+        buildTree(b, child, cluster, level + 1);
+        makeEntry(&entries[n++], name, ATTR_DIRECTORY, child, 0);
+    }
+    for (unsigned int i = 0; i < b->cfg->filesPerDir; i++) {
+        char name[16];
+        unsigned int size;
+        snprintf(name, sizeof(name), "F%u.DAT", i);
+        unsigned int file = buildSmallFile(b, i, &size);
+        makeEntry(&entries[n++], name, 0x20, file, size);
+    }
+
+    writeEntries(b, cluster, entries, n);
+    free(entries);
+    return cluster;
+}
+
+//lay out a fresh image: boot sector, FSInfo, the directory tree, BIG.DAT, WORK and both FATs
+static void generateImage(BenchConfig* cfg) {
+    ImageBuilder b = {0};
+    b.cfg = cfg;
+    b.clusterSize = 512 * cfg->sectorsPerCluster;
+
+    unsigned int totalSectors = cfg->imageMB * 2048;
+    unsigned int clusters = (totalSectors - BENCH_RESERVED_SECTORS) / cfg->sectorsPerCluster;
+    b.sectorsPerFAT = ((clusters + 2) * 4 + 511) / 512;
+    b.firstDataSector = BENCH_RESERVED_SECTORS + BENCH_NUM_FATS * b.sectorsPerFAT;
+    b.maxCluster = 2 + (totalSectors - b.firstDataSector) / cfg->sectorsPerCluster;
+    b.nextCluster = 2;
+
+    b.fd = open(cfg->imagePath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (b.fd < 0 || ftruncate(b.fd, (off_t)totalSectors * 512) < 0) {
+        perror("Error creating image");
+        exit(1);
+    }
+    b.fat = calloc(b.sectorsPerFAT, 512);
+    if (!b.fat) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    b.fat[0] = 0x0FFFFFF8;
+    b.fat[1] = 0x0FFFFFFF;
+
+    //root holds the tree, BIG.DAT and the WORK directory used by the mutating workloads
+    unsigned int rootEntries = 2 + cfg->fanout + cfg->filesPerDir + 2;
+    unsigned int root = buildChain(&b, dirClustersFor(&b, rootEntries), 0);
+    unsigned int work = buildChain(&b, dirClustersFor(&b, cfg->iterations + 4), 0);
+    DirEntry workDots[2];
+    makeEntry(&workDots[0], ".", ATTR_DIRECTORY, work, 0);
+    makeEntry(&workDots[1], "..", ATTR_DIRECTORY, 0, 0);
+    writeEntries(&b, work, workDots, 2);
+
+    DirEntry* entries = calloc(rootEntries, sizeof(DirEntry));
+    unsigned int n = 0;
+    for (unsigned int i = 0; i < cfg->fanout && cfg->depth > 0; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "D%u", i);
+        unsigned int childEntries = 2 + (cfg->depth > 1 ? cfg->fanout : 0) + cfg->filesPerDir;
+        unsigned int child = buildChain(&b, dirClustersFor(&b, childEntries), 0);
+        buildTree(&b, child, 0, 1);
+        makeEntry(&entries[n++], name, ATTR_DIRECTORY, child, 0);
+    }
+    for (unsigned int i = 0; i < cfg->filesPerDir; i++) {
+        char name[16];
+        unsigned int size;
+        snprintf(name, sizeof(name), "F%u.DAT", i);
+        unsigned int file = buildSmallFile(&b, i, &size);
+        makeEntry(&entries[n++], name, 0x20, file, size);
+    }
+    makeEntry(&entries[n++], "WORK", ATTR_DIRECTORY, work, 0);
+
+    //BIG.DAT is filled with printable bytes so read output is never cut short
+    unsigned long long bigSize = (unsigned long long)cfg->bigFileMB * 1024 * 1024;
+    unsigned int bigClusters = (bigSize + b.clusterSize - 1) / b.clusterSize;
+    unsigned int big = bigClusters ? buildChain(&b, bigClusters, cfg->fragmentation) : 0;
+    unsigned char* pattern = malloc(b.clusterSize);
+    for (unsigned int i = 0; i < b.clusterSize; i++) pattern[i] = 'a' + i % 26;
+    for (unsigned int c = big; c >= 2 && c < 0x0FFFFFF8; c = b.fat[c] & FAT_ENTRY_MASK) {
+        if (pwrite(b.fd, pattern, b.clusterSize, builderOffset(&b, c)) < 0) {
+            perror("Error writing BIG.DAT");
+            exit(1);
+        }
+    }
+    free(pattern);
+    makeEntry(&entries[n++], "BIG.DAT", 0x20, big, (unsigned int)bigSize);
+    writeEntries(&b, root, entries, n);
+    free(entries);
+
+    unsigned char sector[512] = {0};
+    sector[0] = 0xEB; sector[1] = 0x58; sector[2] = 0x90;
+    memcpy(sector + 3, "FATBENCH", 8);
+    *(uint16_t*)(sector + 11) = 512;
+    sector[13] = cfg->sectorsPerCluster;
+    *(uint16_t*)(sector + 14) = BENCH_RESERVED_SECTORS;
+    sector[16] = BENCH_NUM_FATS;
+    sector[21] = 0xF8;
+    *(uint32_t*)(sector + 32) = totalSectors;
+    *(uint32_t*)(sector + 36) = b.sectorsPerFAT;
+    *(uint32_t*)(sector + 44) = root;
+    *(uint16_t*)(sector + 48) = 1;
+    sector[510] = 0x55; sector[511] = 0xAA;
+    bool ok = pwrite(b.fd, sector, 512, 0) == 512;
+
+    memset(sector, 0, sizeof(sector));
+    *(uint32_t*)(sector + 0) = 0x41615252;
+    *(uint32_t*)(sector + 484) = 0x61417272;
+    *(uint32_t*)(sector + 488) = b.maxCluster - 2 - b.usedClusters;
+    *(uint32_t*)(sector + 492) = b.nextCluster;
+    *(uint32_t*)(sector + 508) = 0xAA550000;
+    ok = ok && pwrite(b.fd, sector, 512, 512) == 512;
+
+    for (unsigned int copy = 0; copy < BENCH_NUM_FATS; copy++) {
+        off_t start = ((off_t)BENCH_RESERVED_SECTORS + (off_t)copy * b.sectorsPerFAT) * 512;
+        ok = ok && pwrite(b.fd, b.fat, (size_t)b.sectorsPerFAT * 512, start) == (ssize_t)b.sectorsPerFAT * 512;
+    }
+    if (!ok) {
+        perror("Error writing image metadata");
+        exit(1);
+    }
+    free(b.fat);
+    close(b.fd);
+}
+
+//each timed op is one command, so release its scratch buffers the way executeCommand does
+static void recordOp(Workload* w, double micros, unsigned long bytes) {
+    arenaReset();
+    if (w->count == w->capacity) {
+        w->capacity = w->capacity ? w->capacity * 2 : 1024;
+        w->samples = realloc(w->samples, w->capacity * sizeof(double));
+        if (!w->samples) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    w->samples[w->count++] = micros;
+    w->totalMicros += micros;
+    w->bytes += bytes;
+}
+
+static int compareDoubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void reportWorkload(FILE* out, Workload* w) {
+    if (w->count == 0) {
+        fprintf(out, "%-16s %10s\n", w->name, "skipped");
+        return;
+    }
+    qsort(w->samples, w->count, sizeof(double), compareDoubles);
+    double seconds = w->totalMicros / 1e6;
+    double p50 = w->samples[(w->count - 1) / 2];
+    double p99 = w->samples[(unsigned int)((w->count - 1) * 0.99)];
+    fprintf(out, "%-16s %10u %12.0f %10.1f %10.1f %10.1f\n", w->name, w->count,
+            seconds > 0 ? w->count / seconds : 0, seconds > 0 ? w->bytes / 1048576.0 / seconds : 0, p50, p99);
+}
+
+static void resetContext(DirectoryContext* context, BootSectorInfo* bsi) {
+    context->currentCluster = bsi->rootCluster;
+    strcpy(context->path, "/");
+    context->depth = 0;
+}
+
+//cd down a random path to the deepest level, listing each directory on the way
+static void benchNavigate(int fd, BootSectorInfo* bsi, BenchConfig* cfg, DirectoryContext* context, Workload* w) {
+    for (unsigned int it = 0; it < cfg->iterations && cfg->depth > 0 && cfg->fanout > 0; it++) {
+        resetContext(context, bsi);
+        for (unsigned int level = 0; level < cfg->depth; level++) {
+            char name[16];
+            snprintf(name, sizeof(name), "D%u", (unsigned int)(rand() % cfg->fanout));
+            double start = nowMicros();
+            changeDirectory(fd, name, context, bsi);
+            recordOp(w, nowMicros() - start, 0);
+
+            start = nowMicros();
+            listDirectory(fd, context, bsi);
+            recordOp(w, nowMicros() - start, 0);
+        }
+    }
+    resetContext(context, bsi);
+}
+
+//read BIG.DAT front to back in reads of readSize bytes
+static void benchSequentialRead(int fd, BootSectorInfo* bsi, BenchConfig* cfg, DirectoryContext* context, Workload* w,
+                                unsigned int readSize) {
+    unsigned long long size = (unsigned long long)cfg->bigFileMB * 1024 * 1024;
+    if (size == 0) return;
+    openFile(fd, "BIG.DAT", "-r", context, bsi);
+    for (unsigned long long done = 0; done < size; done += readSize) {
+        unsigned int chunk = size - done < readSize ? size - done : readSize;
+        double start = nowMicros();
+        readFile(fd, "BIG.DAT", chunk, context, bsi);
+        recordOp(w, nowMicros() - start, chunk);
+    }
+    closeFile(fd, "BIG.DAT", context, bsi);
+}
+
+static void benchRandomRead(int fd, BootSectorInfo* bsi, BenchConfig* cfg, DirectoryContext* context, Workload* w) {
+    unsigned long long size = (unsigned long long)cfg->bigFileMB * 1024 * 1024;
+    if (size <= 4096) return;
+    openFile(fd, "BIG.DAT", "-r", context, bsi);
+    for (unsigned int it = 0; it < cfg->iterations; it++) {
+        unsigned long offset = ((unsigned long)rand() * 4096) % (size - 4096);
+        double start = nowMicros();
+        seekFile(fd, "BIG.DAT", offset, context, bsi);
+        readFile(fd, "BIG.DAT", 4096, context, bsi);
+        recordOp(w, nowMicros() - start, 4096);
+    }
+    closeFile(fd, "BIG.DAT", context, bsi);
+}
+
+//creat then rm iterations files in WORK
+static void benchCreateRemove(int fd, BootSectorInfo* bsi, BenchConfig* cfg, DirectoryContext* context, Workload* w) {
+    resetContext(context, bsi);
+    changeDirectory(fd, "WORK", context, bsi);
+    for (int pass = 0; pass < 2; pass++) {
+        for (unsigned int it = 0; it < cfg->iterations; it++) {
+            char name[16];
+            snprintf(name, sizeof(name), "S%u.TMP", it);
+            double start = nowMicros();
+            if (pass == 0) createFile(fd, name, context, bsi);
+            else removeFile(fd, name, context, bsi);
+            recordOp(w, nowMicros() - start, 0);
+        }
+    }
+    resetContext(context, bsi);
+}
+
+//append small records to a new file in WORK, the final close is timed as one more op
+static void benchAppend(int fd, BootSectorInfo* bsi, BenchConfig* cfg, DirectoryContext* context, Workload* w) {
+    char record[BENCH_RECORD_SIZE + 1];
+    memset(record, 'r', BENCH_RECORD_SIZE - 1);
+    record[BENCH_RECORD_SIZE - 1] = '\n';
+    record[BENCH_RECORD_SIZE] = '\0';
+
+    resetContext(context, bsi);
+    changeDirectory(fd, "WORK", context, bsi);
+    createFile(fd, "LOG.DAT", context, bsi);
+    openFile(fd, "LOG.DAT", "-w", context, bsi);
+    for (unsigned int it = 0; it < cfg->iterations * 10; it++) {
+        double start = nowMicros();
+        writeFile(fd, "LOG.DAT", record, context, bsi);
+        recordOp(w, nowMicros() - start, BENCH_RECORD_SIZE);
+    }
+    double start = nowMicros();
+    closeFile(fd, "LOG.DAT", context, bsi);
+    recordOp(w, nowMicros() - start, 0);
+    resetContext(context, bsi);
+}
+
+static void usage() {
+    printf("Usage: ./fatbench [IMAGE] [-s MB] [-k SECTORS_PER_CLUSTER] [-f FANOUT] [-d DEPTH]\n"
+           "                  [-n FILES_PER_DIR] [-b BIG_FILE_MB] [-g FRAGMENTATION_PERCENT]\n"
+           "                  [-i ITERATIONS] [-r SEED] [-m] [-c CACHE_CLUSTERS] [-q QUEUE_DEPTH]\n"
+           "                  [-G GROUP_COMMIT_COMMANDS] [-o OVERLAY] [--keep]\n");
+}
+
+int main(int argc, char* argv[]) {
+    BenchConfig cfg = {"bench.img", 256, 8, 4, 5, 8, 64, 20, 2000, 1, false, DEFAULT_CACHE_CLUSTERS, false};
+
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (strcmp(arg, "-m") == 0) cfg.useMmap = true;
+        else if (strcmp(arg, "--keep") == 0) cfg.keepImage = true;
+        else if (strcmp(arg, "-s") == 0 && hasValue) cfg.imageMB = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(arg, "-k") == 0 && hasValue) cfg.sectorsPerCluster = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(arg, "-f") == 0 && hasValue) cfg.fanout = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(arg, "-d") == 0 && hasValue) cfg.depth = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(arg, "-n") == 0 && hasValue) cfg.filesPerDir = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(arg, "-b") == 0 && hasValue) cfg.bigFileMB = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(arg, "-g") == 0 && hasValue) cfg.fragmentation = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(arg, "-i") == 0 && hasValue) cfg.iterations = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(arg, "-r") == 0 && hasValue) cfg.seed = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(arg, "-c") == 0 && hasValue) cfg.cacheClusters = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(arg, "-q") == 0 && hasValue) ioQueueDepth = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(arg, "-G") == 0 && hasValue) groupCommit.interval = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(arg, "-o") == 0 && hasValue) overlayPath = argv[++i];
+        else if (arg[0] != '-') cfg.imagePath = arg;
+        else {
+            usage();
+            return 1;
+        }
+    }
+    if (cfg.sectorsPerCluster == 0 || (cfg.sectorsPerCluster & (cfg.sectorsPerCluster - 1)) || cfg.sectorsPerCluster > 128 || cfg.imageMB == 0) {
+        printf("Error: sectors per cluster must be a power of two up to 128 and the image size nonzero\n");
+        return 1;
+    }
+
+    srand(cfg.seed);
+    double start = nowMicros();
+    generateImage(&cfg);
+    printf("Generated %s: %u MB, %u B clusters, fanout %u, depth %u, %u files/dir, %u MB BIG.DAT, %u%% fragmentation (%.1f s)\n",
+           cfg.imagePath, cfg.imageMB, 512 * cfg.sectorsPerCluster, cfg.fanout, cfg.depth, cfg.filesPerDir,
+           cfg.bigFileMB, cfg.fragmentation, (nowMicros() - start) / 1e6);
+
+    //a delta left by an earlier run belongs to the image generated before this one
+    if (overlayPath) {
+        unlink(overlayPath);
+    }
+
+    BootSectorInfo bsi;
+    int fd = mountImage(cfg.imagePath, cfg.useMmap, cfg.cacheClusters, &bsi);
+    if (fd < 0) {
+        return 1;
+    }
+    DirectoryContext context = {bsi.rootCluster, "/", "", {0}, 0};
+
+    Workload workloads[] = {
+        {"cd+ls deep", NULL, 0, 0, 0, 0},
+        {"seq read 64K", NULL, 0, 0, 0, 0},
+        {"seq read 4K", NULL, 0, 0, 0, 0},
+        {"rand read 4K", NULL, 0, 0, 0, 0},
+        {"creat+rm", NULL, 0, 0, 0, 0},
+        {"append 100B", NULL, 0, 0, 0, 0},
+    };
+
+    //handler output goes to /dev/null while timing, the report goes to the real stdout
+    batchMode = true;
+    fflush(stdout);
+    int savedStdout = dup(STDOUT_FILENO);
+    int devNull = open("/dev/null", O_WRONLY);
+    if (savedStdout < 0 || devNull < 0 || dup2(devNull, STDOUT_FILENO) < 0) {
+        perror("Error redirecting output");
+        return 1;
+    }
+
+    benchNavigate(fd, &bsi, &cfg, &context, &workloads[0]);
+    benchSequentialRead(fd, &bsi, &cfg, &context, &workloads[1], 65536);
+    benchSequentialRead(fd, &bsi, &cfg, &context, &workloads[2], 4096);
+    benchRandomRead(fd, &bsi, &cfg, &context, &workloads[3]);
+    benchCreateRemove(fd, &bsi, &cfg, &context, &workloads[4]);
+    benchAppend(fd, &bsi, &cfg, &context, &workloads[5]);
+    unmountImage(fd, &bsi);
+
+    fflush(stdout);
+    dup2(savedStdout, STDOUT_FILENO);
+    close(devNull);
+    close(savedStdout);
+
+    printf("%-16s %10s %12s %10s %10s %10s\n", "workload", "ops", "ops/s", "MB/s", "p50(us)", "p99(us)");
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+        reportWorkload(stdout, &workloads[i]);
+        free(workloads[i].samples);
+    }
+
+    if (!cfg.keepImage) {
+        unlink(cfg.imagePath);
+        if (overlayPath) unlink(overlayPath);
+    }
+    return 0;
+}